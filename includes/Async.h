@@ -1,38 +1,108 @@
 #pragma once
 
 #include <atomic>
+#include <vector>
+#include <unordered_map>
+#include <ev++.h>
 #include <Exceptions.h>
 #include <Local.h>
+#include <Task.h>
 #include <Threads.h>
 
 namespace Balau {
 
 class AsyncManager;
 class AsyncFinishWorker;
+class AsyncMainWorker;
 
 typedef void (*IdleReadyCallback_t)(void *);
 
-class AsyncOperation {
+class AsyncOperation : public QueueNode {
+  public:
+    // Gives up on the operation. If no worker picked it up yet, run() is skipped altogether; long operations can
+    // also poll isCanceled() to stop early. done() still gets called either way.
+    virtual void cancel();
+    bool isCanceled() { return m_canceled.load(std::memory_order_relaxed); }
   protected:
-      AsyncOperation() { }
+      AsyncOperation() : m_state(QUEUED), m_canceled(false) { }
+    // whether run() got skipped because of a cancel
+    bool wasSkipped() { return m_state.load() == SKIPPED; }
     virtual void run() { }
     virtual void finish() { }
     virtual void done() { }
     virtual bool needsMainQueue() { return true; }
     virtual bool needsFinishWorker() { return false; }
     virtual bool needsSynchronousCallback() { return true; }
+    // main queue operations sharing the same key are run in order, by the same worker; -1 lets any worker run it.
+    virtual intptr_t orderingKey() { return -1; }
   protected:
       virtual ~AsyncOperation() { }
   private:
     CQueue<AsyncOperation> * m_idleQueue = NULL;
+    ev_tstamp m_queuedAt = 0;
     IdleReadyCallback_t m_idleReadyCallback = NULL;
     void * m_idleReadyParam = NULL;
+    enum { QUEUED, RUNNING, SKIPPED };
+    std::atomic<int> m_state;
+    std::atomic<bool> m_canceled;
+    Task * m_task = NULL;
+    AsyncOperation * m_taskPrev = NULL, * m_taskNext = NULL;
+    // the ordering key the AsyncManager routed us with, if any
+    intptr_t m_routedKey = -1;
     void finalize();
+    // called right before run(); false if the operation got canceled first, and shouldn't run.
+    bool startRunning() {
+        int expected = QUEUED;
+        return m_state.compare_exchange_strong(expected, RUNNING);
+    }
+    void attachToTask(Task * task);
+    void detachFromTask();
       AsyncOperation(const AsyncOperation &) = delete;
     AsyncOperation & operator=(const AsyncOperation &) = delete;
 
     friend class AsyncManager;
     friend class AsyncFinishWorker;
+    friend class AsyncMainWorker;
+    friend class AsyncBatch;
+    friend class Task;
+};
+
+// Groups operations so they go through the AsyncManager as a single one: a worker runs them back to back, their
+// done() are all called in a row on the submitting thread, and the submitting task is woken up only once, when all
+// of them are done (ALL), or as soon as the first one has run (ANY). In ANY mode, the batch still has to go through
+// waitAll() before being deleted. The operations of a batch may have at most one ordering key between them, which the
+// batch then takes for itself.
+class AsyncBatch : public AsyncOperation {
+  public:
+    enum WakeMode { ALL, ANY };
+      AsyncBatch(WakeMode mode = ALL) : m_mode(mode), m_completed(0) { }
+      virtual ~AsyncBatch() { AAssert(!m_submitted || m_done, "Can't delete a batch that's still running."); }
+    void add(AsyncOperation * op);
+    // has to be called by the task that's going to wait on the batch.
+    void submit();
+    void wait();
+    void waitAll();
+    // cancels all of the operations that haven't run yet
+    virtual void cancel();
+    // how many operations have run so far
+    int completed() { return m_completed.load(); }
+    bool isDone() { return m_done; }
+  protected:
+    virtual void run();
+    virtual void finish();
+    virtual void done();
+    virtual bool needsFinishWorker();
+    virtual intptr_t orderingKey() { return m_key; }
+  private:
+      AsyncBatch(const AsyncBatch &) = delete;
+    AsyncBatch & operator=(const AsyncBatch &) = delete;
+    std::vector<AsyncOperation *> m_ops;
+    WakeMode m_mode;
+    std::atomic<int> m_completed;
+    intptr_t m_key = -1;
+    bool m_submitted = false;
+    bool m_done = false;
+    Events::Async m_anyEvt, m_allEvt;
 };
 
 class AsyncFinishWorker : public Thread {
@@ -49,18 +119,77 @@ class AsyncFinishWorker : public Thread {
     std::atomic<bool> m_stopped;
 };
 
+struct AsyncStats {
+    int queueDepth = 0;         // operations waiting in that worker's queue right now
+    uint64_t ops = 0;           // operations run so far
+    ev_tstamp totalWait = 0;    // time spent between queueOp() and run()
+    ev_tstamp maxWait = 0;
+    ev_tstamp totalRun = 0;     // time spent in run()
+    ev_tstamp maxRun = 0;
+};
+
+// Runs the main queue operations of one shard.
+class AsyncMainWorker : public Thread {
+  public:
+      AsyncMainWorker(AsyncManager * async) : m_async(async) { }
+    AsyncStats getStats();
+  private:
+      AsyncMainWorker(const AsyncMainWorker &) = delete;
+    AsyncMainWorker & operator=(const AsyncMainWorker &) = delete;
+    virtual void * proc();
+    AsyncManager * m_async;
+    Queue<AsyncOperation> m_queue;
+    Lock m_statsLock;
+    AsyncStats m_stats;
+
+    friend class AsyncManager;
+};
+
+struct AsyncFinisherStats {
+    int finishers = 0;          // threads in the pool right now
+    int idle = 0;               // how many of them are waiting for work
+    int maxFinishers = 0;
+    uint64_t ops = 0;           // operations taken from the finishers' queue so far
+    ev_tstamp totalWait = 0;    // time these operations spent in the queue
+    ev_tstamp maxWait = 0;
+    ev_tstamp avgWait = 0;      // the moving average the pool is sized on
+    ev_tstamp totalIdle = 0;    // time the finishers spent waiting for work
+    uint64_t grown = 0, shrunk = 0;
+};
+
 class AsyncManager : public Thread {
   public:
-      AsyncManager() : m_numTLSes(0), m_ready(false), m_stopperPushed(false) { }
+      AsyncManager() : m_numTLSes(0), m_numMainWorkers(0), m_nextMainWorker(0), m_numFinishers(0), m_numFinishersIdle(0), m_pendingStoppers(0), m_minIdle(1), m_maxIdle(4), m_maxFinishers(getCPUCount()), m_targetWait(0.002), m_ready(false), m_stopperPushed(false), m_tickPushed(false), m_draining(false), m_growRequested(false) {
+          pthread_mutex_init(&m_stateLock, NULL);
+          pthread_cond_init(&m_stateCond, NULL);
+      }
+      ~AsyncManager();
     void setFinishers(int minIdle, int maxIdle) {
         AAssert(minIdle < maxIdle, "Minimum number of threads needs to be less than maximum number of threads.");
         m_minIdle = minIdle;
         m_maxIdle = maxIdle;
+        tick();
+    }
+    // The finishers pool grows past the idle bounds while operations wait in its queue for longer than targetWait
+    // on average, up to maxFinishers threads; that defaults to the number of CPUs.
+    void setFinishersTarget(int maxFinishers, ev_tstamp targetWait) {
+        AAssert(maxFinishers >= 1, "Need at least one finisher.");
+        m_maxFinishers = maxFinishers;
+        m_targetWait = targetWait;
     }
+    AsyncFinisherStats getFinisherStats();
+    static const int MAX_MAIN_WORKERS = 64;
+    // Number of threads running main queue operations. The pool only grows: lowering it leaves the extra threads idle.
+    // Operations with an ordering key are sharded over the workers in use; a key that still has operations in flight
+    // stays on the worker it was on, so that changing this can't reorder them.
+    void setMainWorkers(int n);
+    // one entry per main queue worker currently in use
+    std::vector<AsyncStats> getStats();
     void setIdleReadyCallback(IdleReadyCallback_t idleReadyCallback, void * param);
     void queueOp(AsyncOperation * op);
     void idle();
     bool isReady() { return m_ready; }
+    static int getCPUCount();
 
   protected:
     virtual void threadExit();
@@ -69,10 +198,18 @@ class AsyncManager : public Thread {
       AsyncManager(const AsyncManager &) = delete;
       AsyncManager & operator=(const AsyncManager &) = delete;
     void checkIdle();
-    void killOneFinisher();
+    void killFinishers(int n);
     void startOneFinisher();
     void joinStoppedFinishers();
+    void finisherGotOp(ev_tstamp idle, ev_tstamp wait);
+    void queueFinish(AsyncOperation * op) { op->m_queuedAt = ev_time(); m_finished.push(op); }
     void stopAllWorkers();
+    void waitReady();
+    void waitIdleQueuesDrained();
+    void startMainWorkers();
+    AsyncMainWorker * routeKey(intptr_t key, int n);
+    void unrouteKey(intptr_t key);
+    void tick();
     virtual void * proc();
     struct TLS {
         CQueue<AsyncOperation> idleQueue;
@@ -89,24 +226,55 @@ class AsyncManager : public Thread {
         }
         return tls;
     }
+    // only carries the manager's own control operations; actual work goes to the main workers' queues.
     Queue<AsyncOperation> m_queue;
     Queue<AsyncOperation> m_finished;
     Queue<TLS> m_TLSes;
     std::atomic<int> m_numTLSes;
     PThreadsTLSManager m_tlsManager;
     std::list<AsyncFinishWorker *> m_workers;
-    int m_numFinishers = 0;
-    int m_numFinishersIdle = 0;
-    int m_minIdle = 1;
-    int m_maxIdle = 4;
+    AsyncMainWorker * m_mainWorkers[MAX_MAIN_WORKERS] = { NULL };
+    std::atomic<int> m_numMainWorkers;
+    int m_startedMainWorkers = 0;
+    int m_wantedMainWorkers = 4;
+    // which worker each key with operations in flight is on, and how many of them there are; striped by key.
+    struct KeyRoute {
+        AsyncMainWorker * worker;
+        int inFlight;
+    };
+    struct RouteStripe {
+        Lock lock;
+        std::unordered_map<intptr_t, KeyRoute> routes;
+    };
+    static const int ROUTE_STRIPES = 64;
+    RouteStripe m_routes[ROUTE_STRIPES];
+    std::atomic<unsigned> m_nextMainWorker;
+    Lock m_mainWorkersLock;
+    std::atomic<int> m_numFinishers;
+    std::atomic<int> m_numFinishersIdle;
+    std::atomic<int> m_pendingStoppers;
+    // written by the setters from any thread, read by the finishers
+    std::atomic<int> m_minIdle;
+    std::atomic<int> m_maxIdle;
+    std::atomic<int> m_maxFinishers;
+    std::atomic<ev_tstamp> m_targetWait;
+    Lock m_finisherStatsLock;
+    AsyncFinisherStats m_finisherStats;
+    std::atomic<bool> m_growRequested;
     bool m_stopping = false;
     std::atomic<bool> m_ready;
     std::atomic<bool> m_stopperPushed;
+    std::atomic<bool> m_tickPushed;
+    // startup and shutdown handshakes with the threads using us; a raw mutex, since it goes with a condition.
+    pthread_mutex_t m_stateLock;
+    pthread_cond_t m_stateCond;
+    std::atomic<bool> m_draining;
 
-    void incIdle() { m_numFinishersIdle++; }
-    void decIdle() { m_numFinishersIdle--; }
+    void incIdle() { if (++m_numFinishersIdle > m_maxIdle) tick(); }
+    void decIdle() { if (--m_numFinishersIdle < m_minIdle) tick(); }
 
     friend class AsyncFinishWorker;
+    friend class AsyncMainWorker;
 };
 
 };
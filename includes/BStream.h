@@ -6,20 +6,41 @@ namespace Balau {
 
 class BStream : public Filter {
   public:
-      BStream(IO<Handle> h);
+    static const size_t DEFAULT_BLOCK_SIZE = 16 * 1024;
+    static const size_t MIN_BLOCK_SIZE = 1024;
+    static const size_t MAX_BLOCK_SIZE = 1024 * 1024;
+      BStream(IO<Handle> h, size_t blockSize = DEFAULT_BLOCK_SIZE);
+      virtual ~BStream() override { releaseBuffer(); }
     virtual void close() throw (GeneralException) override;
     virtual bool isEOF() override { return (m_availBytes == 0) && Filter::isEOF(); }
     virtual const char * getName() override { return m_name.to_charp(); }
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException);
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException);
+    // we only buffer reads; writes go through untouched.
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException) override { return getIO()->writev(iov, iovcnt); }
     int peekNextByte();
     String readString(bool putNL = false);
     bool isEmpty() { return m_availBytes == 0; }
+    // how much we try to read at once from the underlying handle; reads at least that large skip our buffer.
+    void setBlockSize(size_t blockSize);
+    size_t getBlockSize() { return m_blockSize; }
+    // lets the block size follow what the reads bring in: it doubles after a few reads that fill it up, and
+    // halves after a few that only bring a fraction of it.
+    void setAdaptive(bool adaptive) { m_adaptive = adaptive; m_fullReads = m_shortReads = 0; }
   private:
+    void adapt(size_t got);
+    // reads a new block into our buffer, which we borrow from the IOBufferPool only while it holds data.
+    ssize_t fill();
+    void releaseBuffer();
     uint8_t * m_buffer = NULL;
+    size_t m_bufferSize = 0;
     size_t m_availBytes = 0;
     size_t m_cursor = 0;
+    size_t m_blockSize;
     String m_name;
     bool m_passThru = false;
+    bool m_adaptive = false;
+    int m_fullReads = 0, m_shortReads = 0;
 };
 
 };
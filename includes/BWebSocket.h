@@ -4,22 +4,26 @@
 #include <StacklessTask.h>
 #include <BStream.h>
 #include <HttpServer.h>
+#include <IOBufferPool.h>
 
 namespace Balau {
 
 class WebSocketActionBase;
 
-class WebSocketFrame {
+class WebSocketFrame : public QueueNode {
   public:
       WebSocketFrame(const String & str, uint8_t opcode = 1, bool mask = false) : WebSocketFrame((uint8_t *) str.to_charp(), str.strlen(), opcode, mask) { }
       WebSocketFrame(size_t len, uint8_t opcode = 1, bool mask = false) : WebSocketFrame(NULL, len, opcode, mask) { }
       WebSocketFrame(const uint8_t * data, size_t len, uint8_t opcode = 1, bool mask = false);
-      ~WebSocketFrame() { free(m_data); }
+      ~WebSocketFrame() { IOBufferPool::release(m_data, m_dataSize); }
     uint8_t & operator[](size_t idx);
-    uint8_t * getPtr() { return m_data + m_headerSize; }
+    uint8_t * getPtr() { return m_data; }
     void send(IO<Handle> socket);
   private:
+    uint8_t m_header[14];
     uint8_t * m_data = NULL;
+    size_t m_dataSize = 0;
+    struct iovec m_iov[2];
     size_t m_len = 0;
     size_t m_headerSize = 0;
     uint32_t m_mask = 'BLAH';
@@ -53,7 +57,9 @@ private:
         READ_PL,
     } m_status = READ_H;
     enum { MAX_WEBSOCKET_LIMIT = 4 * 1024 * 1024 };
+    // payloads come from the IOBufferPool, and go back there once their message got processed.
     uint8_t * m_payload = NULL;
+    size_t m_payloadSize = 0;
     WebSocketFrame * m_sending = NULL;
     TQueue<WebSocketFrame> m_sendQueue;
     uint64_t m_payloadLen;
@@ -63,6 +69,7 @@ private:
     uint8_t m_opcode;
 
     uint8_t * m_payloadCTRL = NULL;
+    size_t m_payloadSizeCTRL = 0;
     uint64_t m_payloadLenCTRL;
     uint64_t m_totalLenCTRL;
     uint64_t m_remainingBytesCTRL;
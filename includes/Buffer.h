@@ -12,6 +12,8 @@ class Buffer : public SeekableHandle {
     virtual void close() throw (GeneralException) override;
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException) override;
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) override;
+    // straight from our memory, without the intermediate copy
+    virtual ssize_t transferTo(IO<Handle> dest, size_t count) throw (GeneralException) override;
     virtual bool isClosed() override { return false; }
     virtual bool isEOF() override { return rtell() == m_bufSize; }
     virtual bool canRead() override { return true; }
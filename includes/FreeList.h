@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <Local.h>
+#include <Task.h>
+
+namespace Balau {
+
+// How many allocations all of the Pooled classes together had to ask malloc for, because their free list was empty.
+inline std::atomic<uint64_t> & freeListMallocs() {
+    static std::atomic<uint64_t> mallocs(0);
+    return mallocs;
+}
+
+// Deriving T from Pooled<T> recycles the memory of T objects through per-thread free lists, instead of going
+// through malloc and free for each of them. An object freed by another thread than the one that allocated it
+// simply ends up in that other thread's list. Classes deriving from T, being larger, bypass the lists.
+template<class T, unsigned MaxFree = 64>
+class Pooled {
+  public:
+    static void * operator new(size_t size) {
+        FreeList * list = freeList();
+        if ((size == sizeof(T)) && list->m_head) {
+            Block * b = list->m_head;
+            list->m_head = b->m_next;
+            list->m_count--;
+            return b;
+        }
+        ++freeListMallocs();
+        void * r = malloc(size < sizeof(Block) ? sizeof(Block) : size);
+        if (!r)
+            throw std::bad_alloc();
+        return r;
+    }
+    static void operator delete(void * ptr, size_t size) {
+        if (!ptr)
+            return;
+        FreeList * list = freeList();
+        if ((size != sizeof(T)) || (list->m_count >= MaxFree)) {
+            free(ptr);
+            return;
+        }
+        Block * b = static_cast<Block *>(ptr);
+        b->m_next = list->m_head;
+        list->m_head = b;
+        list->m_count++;
+    }
+  private:
+    struct Block {
+        Block * m_next;
+    };
+    struct FreeList {
+          ~FreeList() { while (m_head) { Block * b = m_head; m_head = b->m_next; free(b); } }
+        Block * m_head = NULL;
+        unsigned m_count = 0;
+    };
+    static FreeList * freeList() {
+        // never destroyed: pooled objects may still get freed while the process exits.
+        static PThreadsTLSFactory<FreeList> * tls = new PThreadsTLSFactory<FreeList>();
+        return tls->get();
+    }
+};
+
+};
@@ -14,6 +14,18 @@ typedef __int64 off64_t;
 typedef off_t off64_t;
 #endif
 
+#ifdef _WIN32
+struct iovec {
+    void * iov_base;
+    size_t iov_len;
+};
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#else
+#include <sys/uio.h>
+#endif
+
 namespace Balau {
 
 class FileSystem {
@@ -62,6 +74,19 @@ class Handle {
     virtual bool canEAgainOnWrite() { return true; }
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException) WARN_UNUSED_RESULT;
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) WARN_UNUSED_RESULT;
+    // Scatter / gather versions of read and write; like theirs, the result may be short. Handles that can do it
+    // natively move all of the buffers in one go; the default goes through read and write, one buffer at a time.
+    // The iovec array has to stay around until the call returns, including across an EAgain.
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException) WARN_UNUSED_RESULT;
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException) WARN_UNUSED_RESULT;
+    // Moves up to count bytes from this handle into dest, and returns how many got moved; 0 means we're at the
+    // end. A file going to a socket doesn't go through user space at all, where the system can do it; otherwise,
+    // this is a read followed by a forceWrite, which only works from simple tasks.
+    virtual ssize_t transferTo(IO<Handle> dest, size_t count) throw (GeneralException) WARN_UNUSED_RESULT;
+    // The receiving end of transferTo: whether this handle can take data straight from a file descriptor, and
+    // doing it. receiveFile doesn't touch fd's own offset.
+    virtual bool canReceiveFile() { return false; }
+    virtual ssize_t receiveFile(int fd, off64_t offset, size_t count) throw (GeneralException) WARN_UNUSED_RESULT;
     virtual void rseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException);
     virtual void wseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException) { return rseek(offset, whence); }
     virtual off64_t rtell() throw (GeneralException);
@@ -135,6 +160,13 @@ class Handle {
     ssize_t writeString(const char * str, ssize_t len) WARN_UNUSED_RESULT { return forceWrite(str, len); }
     ssize_t forceRead(void * buf, size_t count, Events::BaseEvent * evt = NULL) throw (GeneralException) WARN_UNUSED_RESULT;
     ssize_t forceWrite(const void * buf, size_t count, Events::BaseEvent * evt = NULL) throw (GeneralException) WARN_UNUSED_RESULT;
+    ssize_t forceWritev(const struct iovec * iov, int iovcnt, Events::BaseEvent * evt = NULL) throw (GeneralException) WARN_UNUSED_RESULT;
+    static size_t iovSize(const struct iovec * iov, int iovcnt) {
+        size_t r = 0;
+        for (int i = 0; i < iovcnt; i++)
+            r += iov[i].iov_len;
+        return r;
+    }
 
   protected:
       Handle() : m_refCount(0) { }
@@ -240,6 +272,10 @@ public:
     virtual const char * getName() override { return m_io->getName(); }
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException) override { return m_io->read(buf, count); }
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) override { return m_io->write(buf, count); }
+    // readv and writev stay Handle's, going through our read and write one buffer at a time, and we can't take
+    // files directly: a filter that changes the data would get bypassed. Filters passing the data through as it
+    // is can forward these to their handle themselves.
+    virtual ssize_t receiveFile(int fd, off64_t offset, size_t count) throw (GeneralException) override { return m_io->receiveFile(fd, offset, count); }
     virtual void rseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException) override { m_io->rseek(offset, whence); }
     virtual void wseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException) override { m_io->wseek(offset, whence); }
     virtual off64_t rtell() throw (GeneralException) override { return m_io->rtell(); }
@@ -261,6 +297,8 @@ class ReadOnly : public Filter {
     virtual bool canRead() override { return true; }
     virtual bool canWrite() override { return false; }
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) override { throw GeneralException("Can't write"); }
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException) override { throw GeneralException("Can't write"); }
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException) override { return getIO()->readv(iov, iovcnt); }
     virtual void wseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException) override { throw GeneralException("Can't write"); }
     virtual off64_t wtell() throw (GeneralException) override { throw GeneralException("Can't write"); }
 };
@@ -271,6 +309,8 @@ class WriteOnly : public Filter {
     virtual bool canRead() override { return false; }
     virtual bool canWrite() override { return true; }
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException) override { throw GeneralException("Can't read"); }
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException) override { throw GeneralException("Can't read"); }
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException) override { return getIO()->writev(iov, iovcnt); }
     virtual void rseek(off64_t offset, int whence = SEEK_SET) throw (GeneralException) override { throw GeneralException("Can't read"); }
     virtual off64_t rtell() throw (GeneralException) override { throw GeneralException("Can't read"); }
 };
@@ -11,10 +11,14 @@ namespace Balau {
 class CopyTask : public StacklessTask {
   public:
       CopyTask(IO<Handle> s, IO<Handle> d, ssize_t tocopy = -1);
+      ~CopyTask() { releaseBuffer(); }
     virtual const char * getName() const override { return m_name.to_charp(); }
     virtual void Do();
   private:
-    char m_buffer[COPY_BUFSIZE];
+    // borrowed from the IOBufferPool, and given back whenever we're waiting for the source.
+    void releaseBuffer();
+    uint8_t * m_buffer = NULL;
+    size_t m_bufferSize = 0;
     IO<Handle> m_s, m_d;
     ssize_t m_tocopy, m_current = 0, m_written, m_read;
     size_t m_towrite;
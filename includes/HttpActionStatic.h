@@ -8,9 +8,13 @@ class HttpActionStatic : public HttpServer::Action {
   public:
       // the regex needs a capture on the file name.
       HttpActionStatic(const String & base, Regex & url) : Action(url), m_base(base) { }
+    // Sends files straight from the disk to the socket with their size as Content-Length, instead of reading
+    // them in memory first.
+    void setStreaming(bool streaming) { m_streaming = streaming; }
   private:
     virtual bool Do(HttpServer * server, Http::Request & req, HttpServer::Action::ActionMatch & match, IO<Handle> out) throw (GeneralException);
     String m_base;
+    bool m_streaming = false;
 };
 
 };
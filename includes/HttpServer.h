@@ -10,6 +10,7 @@
 #include <Threads.h>
 #include <Handle.h>
 #include <Buffer.h>
+#include <SegmentedBuffer.h>
 #include <Http.h>
 
 namespace Balau {
@@ -25,9 +26,15 @@ class HttpServer {
         void SetResponseCode(int code) { m_responseCode = code; }
         void SetContentType(const String & type) { m_type = type; }
         void setNoSize() { m_noSize = true;  }
-        IO<Buffer> get() { return m_buffer; }
-        IO<Buffer> operator->() { return m_buffer; }
+        IO<Buffer> get() { AAssert(!m_segmented, "This response's body is being built with getSegmented()."); return m_buffer; }
+        IO<Buffer> operator->() { return get(); }
+        // Builds the body in a SegmentedBuffer instead, so that a large one doesn't get copied around while it
+        // grows; once called, the body has to be written through getSegmented() only.
+        IO<SegmentedBuffer> getSegmented();
         void Flush();
+        // Sends the headers with a Content-Length of length, then length bytes of body, moved with transferTo;
+        // that's instead of the buffer and Flush().
+        void Stream(IO<Handle> body, off64_t length);
         void AddHeader(const String & line) { m_extraHeaders.push_front(line); }
         void AddHeader(const String & key, const String & val) { AddHeader(key + ": " + val); }
       private:
@@ -36,12 +43,15 @@ class HttpServer {
         IO<Handle> m_out;
 
         IO<Buffer> m_buffer;
+        IO<SegmentedBuffer> m_segments;
         int m_responseCode;
         String m_type;
         std::list<String> m_extraHeaders;
         bool m_flushed;
         bool m_noSize = false;
+        bool m_segmented = false;
 
+        IO<Buffer> buildHeaders(off64_t contentLength);
           Response(const Response &) = delete;
         Response & operator=(const Response &) = delete;
     };
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Balau {
+
+// Per-thread pools of I/O buffers, in power of two sizes from MIN_SIZE to MAX_SIZE. Streams borrow a buffer only
+// while they have data in flight, and give it back once it's drained, so that idle connections don't pin any
+// memory. A buffer returned on another thread than the one that took it goes into that other thread's pool.
+// Bigger requests go straight to malloc.
+class IOBufferPool {
+  public:
+    static const size_t MIN_SIZE = 4 * 1024;
+    static const size_t MAX_SIZE = 1024 * 1024;
+    // how much memory each thread keeps around at most, per size.
+    static const size_t MAX_CACHED = 1024 * 1024;
+    // size gets rounded up to the size of the buffer we really give out, which is what release() wants back.
+    static uint8_t * acquire(size_t & size);
+    static void release(uint8_t * buffer, size_t size);
+    struct Stats {
+        uint64_t hits, misses;
+        // bytes handed out right now, and bytes sitting in the pools, all threads together.
+        int64_t inUse, cached;
+    };
+    static Stats getStats();
+  private:
+    static const int NUM_SIZES = 9;
+    static int sizeIndex(size_t size);
+    static std::atomic<uint64_t> s_hits, s_misses;
+    static std::atomic<int64_t> s_inUse, s_cached;
+    friend struct IOBufferPoolTLS;
+};
+
+};
@@ -11,6 +11,8 @@ class Input : public SeekableHandle {
     void open() throw (GeneralException);
     virtual void close() throw (GeneralException);
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException);
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException);
+    virtual ssize_t transferTo(IO<Handle> dest, size_t count) throw (GeneralException);
     virtual bool isClosed();
     virtual bool canRead();
     virtual const char * getName();
@@ -18,12 +20,30 @@ class Input : public SeekableHandle {
     virtual time_t getMTime();
     virtual bool isPendingComplete();
     const char * getFName() { return m_fname.to_charp(); }
+    enum Advice {
+        ADVICE_NORMAL,
+        ADVICE_SEQUENTIAL,
+        ADVICE_RANDOM,
+        ADVICE_WILLNEED,
+        ADVICE_DONTNEED,
+        ADVICE_NOREUSE,
+        ADVICE_READAHEAD,
+    };
+    // Tells the kernel how a range of the file is going to be read; a len of 0 goes up to the end of the file.
+    // These are hints, run on the async threads: they never fail, and do nothing where the system has no such thing.
+    void fadvise(off64_t offset, off64_t len, Advice advice) throw (GeneralException);
+    // starts pulling the range into the page cache, so that reading it later doesn't wait on the disk.
+    void readahead(off64_t offset, off64_t len) throw (GeneralException);
   private:
+    static const size_t TRANSFER_CHUNK = 1024 * 1024;
+    ssize_t readInternal(const struct iovec * iov, int iovcnt) throw (GeneralException);
     int m_fd = -1;
     String m_name;
     String m_fname;
     off64_t m_size = -1;
     time_t m_mtime = -1;
+    // what transferTo() already asked to be read ahead
+    off64_t m_aheadFrom = 0, m_aheadTo = 0;
     void * m_pendingOp = NULL;
 };
 
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <ev++.h>
+#include <Task.h>
+
+#ifdef HAVE_IO_URING
+#include <sys/stat.h>
+#include <linux/io_uring.h>
+#endif
+
+namespace Balau {
+
+// Where a file operation reports back, whichever way it went: result is what the syscall returned, and
+// errorno its errno when it failed.
+struct IoResults {
+    Events::Custom evt;
+    ssize_t result = 0;
+    int errorno = 0;
+};
+
+#ifdef HAVE_IO_URING
+
+// One io_uring per TaskMan, driven through the raw syscalls. Tasks queue their file operations directly in the
+// submission ring; the TaskMan submits them all at once before going into libev, and the ring's eventfd, watched
+// by libev, lets us reap completions and signal the tasks from the TaskMan's own thread.
+// Each prep call returns false if the operation can't go through the ring; the caller then uses the AsyncManager.
+class IoUring {
+  public:
+    // returns NULL if the kernel doesn't have io_uring, or lacks one of the operations we need.
+    static IoUring * create(struct ev_loop * loop);
+      ~IoUring();
+    bool prepOpen(IoResults * r, const char * path, int flags, mode_t mode);
+    bool prepStat(IoResults * r, int fd, struct statx * stx);
+    bool prepRead(IoResults * r, int fd, void * buf, size_t count, off64_t offset);
+    bool prepWrite(IoResults * r, int fd, const void * buf, size_t count, off64_t offset);
+    bool prepReadv(IoResults * r, int fd, const struct iovec * iov, int iovcnt, off64_t offset);
+    bool prepWritev(IoResults * r, int fd, const struct iovec * iov, int iovcnt, off64_t offset);
+    bool prepClose(IoResults * r, int fd);
+    // hands the queued operations to the kernel; returns false if some are still waiting for room.
+    bool submit();
+    int inFlight() { return m_inFlight; }
+    // how many operations went all the way through the ring so far
+    uint64_t completed() { return m_completed; }
+  private:
+      IoUring(struct ev_loop * loop) : m_loop(loop) { }
+      IoUring(const IoUring &) = delete;
+    IoUring & operator=(const IoUring &) = delete;
+    static const unsigned ENTRIES = 256;
+    bool setup();
+    struct io_uring_sqe * getSQE(IoResults * r, int opcode);
+    void reap(bool signal);
+    void evt_cb(ev::io & w, int revents);
+    int m_fd = -1, m_eventfd = -1;
+    void * m_sqRing = NULL, * m_cqRing = NULL;
+    size_t m_sqRingSize = 0, m_cqRingSize = 0;
+    struct io_uring_sqe * m_sqes = NULL;
+    size_t m_sqesSize = 0;
+    unsigned * m_sqHead, * m_sqTail, * m_sqMask, * m_sqArray;
+    unsigned * m_cqHead, * m_cqTail, * m_cqMask;
+    struct io_uring_cqe * m_cqes;
+    unsigned m_sqEntries = 0, m_cqEntries = 0;
+    // the tail we've filled entries up to; the kernel only gets to see it in submit()
+    unsigned m_sqLocalTail = 0;
+    unsigned m_toSubmit = 0;
+    int m_inFlight = 0;
+    uint64_t m_completed = 0;
+    struct ev_loop * m_loop;
+    ev::io m_evt;
+};
+
+#endif
+
+};
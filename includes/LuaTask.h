@@ -56,6 +56,9 @@ class LuaTask : public Task {
   public:
       ~LuaTask() { L.weaken(); }
     virtual const char * getName() const { return "LuaTask"; }
+  protected:
+    // the Lua VM and the C functions it calls into can recurse quite deep.
+    virtual size_t stackSize() const { return 256 * 1024; }
   private:
       LuaTask(Lua && __L, LuaExecCell * cell) : L(std::move(__L)), m_cell(cell) { if (!cell->needsStack()) setStackless(); }
     virtual void Do();
@@ -10,6 +10,7 @@ class Output : public SeekableHandle {
     void open(bool truncate = true) throw (GeneralException);
     virtual void close() throw (GeneralException);
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException);
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException);
     virtual bool isClosed();
     virtual bool canWrite();
     virtual const char * getName();
@@ -17,7 +18,19 @@ class Output : public SeekableHandle {
     virtual time_t getMTime();
     virtual bool isPendingComplete();
     const char * getFName() { return m_fname.to_charp(); }
+    // Flush what was written so far to the disk, along with the file's metadata (sync), or with just the metadata
+    // needed to read it back (datasync). Both run on the async threads.
+    void sync() throw (GeneralException);
+    void datasync() throw (GeneralException);
+    // Reserves disk space for the file's first size bytes, so that writing there later can't fail for lack of space.
+    // With keepSize, the file's apparent size doesn't change, which is what append-only logs want. Returns false, with
+    // nothing reserved, when the filesystem can't do it (EOPNOTSUPP); that's always the case on Windows, and with
+    // keepSize on the POSIX systems other than Linux and MacOS X.
+    bool preallocate(off64_t size, bool keepSize = true) throw (GeneralException);
   private:
+    ssize_t writeInternal(const struct iovec * iov, int iovcnt) throw (GeneralException);
+    // false if a preallocation isn't supported
+    bool syncOp(int syncType, off64_t size, const char * what) throw (GeneralException);
     int m_fd = -1;
     String m_name;
     String m_fname;
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <stddef.h>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include <Async.h>
+#include <TaskMan.h>
+#include <Threads.h>
+
+namespace Balau {
+
+// Runs chunks of a job on the AsyncManager's finish workers, and yields the calling task until all of them are
+// done; the TaskMan keeps running its other tasks in the meantime. The first exception a chunk throws cancels
+// the chunks that haven't started yet, and gets thrown back to the caller once the others are done.
+class ParallelJob {
+  public:
+    // how many chunks a range gets split into at most, whatever its grain: a few per CPU, so that uneven chunks
+    // still balance out across the workers.
+    static size_t maxChunks();
+    // has to be called from a simple task, as chunks may still be running off its stack.
+    void runAll();
+  protected:
+      ParallelJob(size_t chunks) : m_chunks(chunks), m_pending(0), m_failed(false) { }
+      virtual ~ParallelJob() { }
+    size_t chunks() { return m_chunks; }
+    // called from the finish workers, several chunks at once.
+    virtual void runChunk(size_t chunk) = 0;
+  private:
+      ParallelJob(const ParallelJob &) = delete;
+    ParallelJob & operator=(const ParallelJob &) = delete;
+    class Chunk;
+    void chunkRun(size_t chunk);
+    void chunkDone();
+    size_t m_chunks;
+    std::atomic<size_t> m_pending;
+    std::atomic<bool> m_failed;
+    std::exception_ptr m_exception;
+    Lock m_exceptionLock;
+    Events::Async m_evt;
+};
+
+template<class Index, class F>
+class ParallelFor : public ParallelJob {
+  public:
+      ParallelFor(Index begin, Index end, size_t chunks, F & fn) : ParallelJob(chunks), m_begin(begin), m_end(end), m_fn(fn) { }
+  protected:
+    Index bound(size_t chunk) { return m_begin + (Index) (((size_t) (m_end - m_begin)) * chunk / chunks()); }
+    virtual void runChunk(size_t chunk) { m_fn(bound(chunk), bound(chunk + 1)); }
+    Index m_begin, m_end;
+    F & m_fn;
+};
+
+template<class T, class Index, class Map>
+class ParallelMap : public ParallelFor<Index, Map> {
+  public:
+      ParallelMap(Index begin, Index end, size_t chunks, Map & map) : ParallelFor<Index, Map>(begin, end, chunks, map), m_results(chunks) { }
+    std::vector<T> & results() { return m_results; }
+  protected:
+    virtual void runChunk(size_t chunk) { m_results[chunk] = this->m_fn(this->bound(chunk), this->bound(chunk + 1)); }
+  private:
+    std::vector<T> m_results;
+};
+
+template<class Index>
+size_t parallelChunks(Index begin, Index end, Index grain) {
+    size_t n = (size_t) (end - begin);
+    size_t g = grain > 0 ? (size_t) grain : 1;
+    size_t chunks = (n + g - 1) / g;
+    size_t maxChunks = ParallelJob::maxChunks();
+    return chunks < maxChunks ? chunks : maxChunks;
+}
+
+// Calls fn(from, to) over consecutive sub-ranges of [begin, end[ about grain long or more, concurrently on the
+// finish workers.
+template<class Index, class F>
+void parallelFor(Index begin, Index end, F fn, Index grain = 1) {
+    if (!(begin < end))
+        return;
+    ParallelFor<Index, F> job(begin, end, parallelChunks(begin, end, grain), fn);
+    job.runAll();
+}
+
+// Same split as parallelFor, with map(from, to) returning each chunk's partial result; these are then folded,
+// in order, with reduce(accumulator, partial) on the calling task, so reduce doesn't need to be commutative.
+template<class T, class Index, class Map, class Reduce>
+T parallelReduce(Index begin, Index end, T init, Map map, Reduce reduce, Index grain = 1) {
+    if (!(begin < end))
+        return init;
+    ParallelMap<T, Index, Map> job(begin, end, parallelChunks(begin, end, grain), map);
+    job.runAll();
+    for (T & partial : job.results())
+        init = reduce(init, partial);
+    return init;
+}
+
+template<class R>
+struct OffloadResult {
+    R value;
+    template<class F>
+    void set(F & fn) { value = fn(); }
+    R take() { return std::move(value); }
+};
+
+template<>
+struct OffloadResult<void> {
+    template<class F>
+    void set(F & fn) { fn(); }
+    void take() { }
+};
+
+template<class R>
+class Offloaded;
+
+template<class R>
+class OffloadOp : public AsyncOperation {
+  protected:
+      OffloadOp() { m_evt.registerOwner(Task::getCurrentTask()); }
+    virtual void done() {
+        m_done = true;
+        if (m_abandoned)
+            delete this;
+        else
+            m_evt.doSignal();
+    }
+    virtual bool needsMainQueue() { return false; }
+    virtual bool needsFinishWorker() { return true; }
+    OffloadResult<R> m_result;
+    std::exception_ptr m_exception;
+  private:
+    // the Offloaded went away first; we'll delete ourselves in done().
+    void release() {
+        if (m_done) {
+            delete this;
+        } else {
+            m_abandoned = true;
+            cancel();
+        }
+    }
+    Events::Async m_evt;
+    bool m_done = false, m_abandoned = false;
+    friend class Offloaded<R>;
+};
+
+template<class R, class F>
+class OffloadFunc : public OffloadOp<R> {
+  public:
+      OffloadFunc(F && fn) : m_fn(std::forward<F>(fn)) { }
+  protected:
+    virtual void run() {
+        try {
+            this->m_result.set(m_fn);
+        }
+        catch (...) {
+            this->m_exception = std::current_exception();
+        }
+    }
+  private:
+    typename std::decay<F>::type m_fn;
+};
+
+// What offload() returns. get() yields the task until the call is done, then returns its result or rethrows its
+// exception; it can be called only once. It's fine to drop an Offloaded without calling get(): the call gets
+// canceled if it didn't start yet, and its result is thrown away.
+template<class R>
+class Offloaded {
+  public:
+      Offloaded(OffloadOp<R> * op) : m_op(op) { }
+      Offloaded(Offloaded && other) : m_op(other.m_op) { other.m_op = NULL; }
+      ~Offloaded() { if (m_op) m_op->release(); }
+    bool isDone() { return m_op->m_done; }
+    R get() {
+        AAssert(m_op, "Can't get the result of a moved offloaded call.");
+        while (!m_op->m_done)
+            Task::operationYield(&m_op->m_evt, Task::INTERRUPTIBLE);
+        if (m_op->m_exception)
+            std::rethrow_exception(m_op->m_exception);
+        if (m_op->wasSkipped())
+            throw GeneralException("Offloaded call got canceled");
+        return m_op->m_result.take();
+    }
+  private:
+      Offloaded(const Offloaded &) = delete;
+    Offloaded & operator=(const Offloaded &) = delete;
+    OffloadOp<R> * m_op;
+};
+
+// Runs fn() on the finish workers, away from the TaskMan. The callable is moved into the operation itself, so
+// that's the only allocation per call.
+template<class F>
+Offloaded<typename std::result_of<F()>::type> offload(F && fn) {
+    typedef typename std::result_of<F()>::type R;
+    AAssert(Task::getCurrentTask(), "Can only offload from a task.");
+    OffloadOp<R> * op = new OffloadFunc<R, F>(std::forward<F>(fn));
+    createAsyncOp(op);
+    return Offloaded<R>(op);
+}
+
+};
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <vector>
+#include <Handle.h>
+#include <FreeList.h>
+
+namespace Balau {
+
+// Same as a Buffer, but its memory is a list of fixed-size segments instead of one contiguous block: growing it
+// never moves or zero-fills what's already written, and the segments come from per-thread free lists. The data
+// isn't contiguous, so instead of a getBuffer() there's getSegments(), to hand them to writev() as they are.
+class SegmentedBuffer : public SeekableHandle {
+  public:
+    static const size_t SEGMENT_SIZE = 16 * 1024;
+      SegmentedBuffer() { }
+      virtual ~SegmentedBuffer() override { reset(); }
+    virtual void close() throw (GeneralException) override { reset(); }
+    virtual ssize_t read(void * buf, size_t count) throw (GeneralException) override;
+    virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) override;
+    // one writev() of our segments, without the intermediate copy
+    virtual ssize_t transferTo(IO<Handle> dest, size_t count) throw (GeneralException) override;
+    virtual bool isClosed() override { return false; }
+    virtual bool isEOF() override { return rtell() == m_size; }
+    virtual bool canRead() override { return true; }
+    virtual bool canWrite() override { return true; }
+    virtual bool canEAgainOnRead() override { return false; }
+    virtual bool canEAgainOnWrite() override { return false; }
+    virtual const char * getName() override { return "SegmentedBuffer"; }
+    virtual off64_t getSize() override { return m_size; }
+    // fills up to iovcnt entries describing the data from offset to the end; returns how many it filled.
+    int getSegments(struct iovec * iov, int iovcnt, off64_t offset = 0);
+    size_t numSegments() { return m_segments.size(); }
+    void reset();
+    void rewind() { rseek(0); wseek(0); }
+  private:
+      SegmentedBuffer(const SegmentedBuffer &) = delete;
+    SegmentedBuffer & operator=(const SegmentedBuffer &) = delete;
+    struct Segment : public Pooled<Segment> {
+        uint8_t data[SEGMENT_SIZE];
+    };
+    std::vector<Segment *> m_segments;
+    off64_t m_size = 0;
+};
+
+};
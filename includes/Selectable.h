@@ -16,6 +16,12 @@ class Selectable : public Handle {
       ~Selectable();
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException);
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException);
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException);
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException);
+#ifdef __linux__
+    virtual bool canReceiveFile() { return true; }
+    virtual ssize_t receiveFile(int fd, off64_t offset, size_t count) throw (GeneralException);
+#endif
     virtual bool isClosed();
     virtual bool isEOF();
 
@@ -45,10 +51,15 @@ class Selectable : public Handle {
     int getFD() { return m_fd; }
     virtual ssize_t recv(int sockfd, void *buf, size_t len, int flags) = 0;
     virtual ssize_t send(int sockfd, const void *buf, size_t len, int flags) = 0;
+    // vectored versions; by default, they only move the first non-empty buffer.
+    virtual ssize_t recvv(int sockfd, const struct iovec * iov, int iovcnt);
+    virtual ssize_t sendv(int sockfd, const struct iovec * iov, int iovcnt);
 
     SelectableEvent * m_evtR = NULL, * m_evtW = NULL;
 
   private:
+    template<class F>
+    ssize_t retryIO(SelectableEvent * evt, F syscall);
     int m_fd = -1;
 };
 
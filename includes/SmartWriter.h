@@ -10,6 +10,9 @@ class SmartWriter : public Filter {
   public:
       SmartWriter(IO<Handle> h) : Filter(h) { AAssert(h->canWrite(), "SmartWriter can't write"); m_name.set("SmartWriter(%s)", h->getName()); }
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException) override;
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException) override;
+    // only while nothing's queued in the writer task, or the file's bytes would overtake the queue.
+    virtual bool canReceiveFile() override { return !m_writerTask && getIO()->canReceiveFile(); }
     virtual const char * getName() override { return m_name.to_charp(); }
     virtual void close() throw (GeneralException) override;
   private:
@@ -23,6 +23,8 @@ class Socket : public Selectable {
       Socket() throw (GeneralException);
     virtual ssize_t read(void * buf, size_t count) throw (GeneralException);
     virtual ssize_t write(const void * buf, size_t count) throw (GeneralException);
+    virtual ssize_t readv(const struct iovec * iov, int iovcnt) throw (GeneralException);
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (GeneralException);
     virtual void close() throw (GeneralException);
     virtual bool canRead();
     virtual bool canWrite();
@@ -38,6 +40,10 @@ class Socket : public Selectable {
 
     virtual ssize_t recv(int sockfd, void *buf, size_t len, int flags);
     virtual ssize_t send(int sockfd, const void *buf, size_t len, int flags);
+#ifndef _WIN32
+    virtual ssize_t recvv(int sockfd, const struct iovec * iov, int iovcnt);
+    virtual ssize_t sendv(int sockfd, const struct iovec * iov, int iovcnt);
+#endif
 
     void resolve(const char * hostname);
     void initAddr(sockaddr_in6 & out);
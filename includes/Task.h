@@ -8,15 +8,44 @@
 #include <setjmp.h>
 #endif
 #include <functional>
+#include <type_traits>
+#include <atomic>
 #include <ev++.h>
 #include <list>
 #include <Exceptions.h>
 #include <Printer.h>
 
+// On Linux x86-64 and aarch64, tasks switch using a small hand-written routine that only saves the callee-saved
+// registers and the stack pointer, instead of swapcontext, which does a sigprocmask syscall on each switch.
+#if defined(__linux) && (defined(__x86_64__) || defined(__aarch64__)) && !defined(BALAU_UCONTEXT)
+#define BALAU_ASM_CONTEXT
+#endif
+
 namespace Balau {
 
+#ifdef BALAU_ASM_CONTEXT
+// The bare switch the tasks use, for benchmarks: prepareContext sets up a stack so that the first switch to it calls
+// func(arg), which must never return; switchContext saves the current context into *from, and resumes to.
+void * prepareContext(void * stack, size_t size, void (*func)(void *), void * arg);
+void switchContext(void ** from, void * to);
+#endif
+
 namespace Events { class BaseEvent; };
 
+class QueueBase;
+
+// Deriving from QueueNode lets an object go through a Queue without allocating a cell for it;
+// such an object can only sit in one queue at a time.
+class QueueNode {
+  protected:
+      QueueNode() : m_queueNext(NULL) { }
+      QueueNode(const QueueNode &) : m_queueNext(NULL) { }
+    QueueNode & operator=(const QueueNode &) { return *this; }
+  private:
+    std::atomic<QueueNode *> m_queueNext;
+    friend class QueueBase;
+};
+
 class Task;
 
 class EAgain : public GeneralException {
@@ -34,6 +63,15 @@ class TaskSwitch : public GeneralException {
 };
 
 class TaskMan;
+class TimerWheel;
+class AsyncOperation;
+
+// Links used to thread a Task into one of the TaskMan's intrusive lists;
+// a task is in at most one list per link.
+struct TaskLink {
+    Task * m_prev = NULL, * m_next = NULL;
+    void * m_owner = NULL;
+};
 
 namespace Events {
 
@@ -49,8 +87,8 @@ class Callback {
 
 class BaseEvent {
   public:
-      BaseEvent() : m_cb(NULL), m_signal(false), m_task(NULL) { Printer::elog(E_TASK, "Creating event at %p", this); }
-      virtual ~BaseEvent() { if (m_cb) delete m_cb; }
+      BaseEvent() : m_cb(NULL), m_signal(false), m_task(NULL), m_postedTo(NULL) { Printer::elog(E_TASK, "Creating event at %p", this); }
+      virtual ~BaseEvent();
     bool gotSignal() { return m_signal; }
     void doSignal();
     void resetMaybe() {
@@ -74,10 +112,16 @@ class BaseEvent {
   protected:
     virtual void gotOwner(Task * task) { }
     virtual bool relaxed() { return false; }
+    // thread-safe version of doSignal(); the event is queued in its owner's TaskMan, and signaled there on its next loop.
+    void postSignal();
   private:
     Callback * m_cb = NULL;
     bool m_signal = false;
-    Task * m_task = NULL;
+    // postSignal() reads it from any thread
+    std::atomic<Task *> m_task;
+    // the TaskMan whose inbox this event is currently waiting in, if any; protected by that TaskMan's inbox lock.
+    std::atomic<TaskMan *> m_postedTo;
+    friend class Balau::TaskMan;
       BaseEvent(const BaseEvent &) = delete;
     BaseEvent & operator=(const BaseEvent &) = delete;
 };
@@ -94,6 +138,25 @@ class Timeout : public BaseEvent {
     ev::timer m_evt;
 };
 
+// Same as Timeout, but backed by the owner's TaskMan TimerWheel instead of a libev timer of its own; much
+// cheaper to arm and disarm, at the cost of a coarser precision. Made for timeouts that seldom fire.
+class CoarseTimeout : public BaseEvent {
+  public:
+      CoarseTimeout() { }
+      CoarseTimeout(ev_tstamp tstamp) { set(tstamp); }
+      virtual ~CoarseTimeout() { cancel(); }
+    void set(ev_tstamp tstamp) { m_delay = tstamp; }
+    void cancel();
+  private:
+    virtual void gotOwner(Task * task);
+    ev_tstamp m_delay = 0;
+    TimerWheel * m_wheel = NULL;
+    CoarseTimeout * m_wheelPrev = NULL, * m_wheelNext = NULL;
+    CoarseTimeout ** m_wheelSlot = NULL;
+    uint64_t m_expires = 0;
+    friend class Balau::TimerWheel;
+};
+
 class TaskEvent : public BaseEvent {
   public:
       TaskEvent(Task * taskWaited = NULL);
@@ -102,25 +165,17 @@ class TaskEvent : public BaseEvent {
     void signal();
     Task * taskWaited() { return m_taskWaited; }
     void attachToTask(Task * taskWaited);
-    void evt_cb(ev::async & w, int revents) { doSignal(); }
   protected:
     virtual void gotOwner(Task * task);
   private:
     Task * m_taskWaited;
     bool m_ack, m_distant;
-    ev::async m_evt;
 };
 
+// can be triggered from any thread; triggers that happen before a task waits on it are lost.
 class Async : public BaseEvent {
   public:
-      Async() { m_evt.set<Async, &Async::evt_cb>(this); }
-      virtual ~Async() { m_evt.stop(); }
-    void trigger() { m_evt.send(); }
-    void evt_cb(ev::async & w, int revents) { doSignal(); }
-  protected:
-    virtual void gotOwner(Task * task);
-  private:
-    ev::async m_evt;
+    void trigger() { postSignal(); }
 };
 
 class Custom : public BaseEvent {
@@ -134,7 +189,7 @@ class Custom : public BaseEvent {
 
 };
 
-class Task {
+class Task : public QueueNode {
   public:
     enum Status {
         STARTING,
@@ -159,6 +214,18 @@ class Task {
       virtual ~Task();
     virtual const char * getName() const = 0;
     Status getStatus() const { return m_status; }
+    enum Priority {
+        PRIORITY_HIGH,
+        PRIORITY_NORMAL,
+        PRIORITY_LOW,
+    };
+    static const int PRIORITY_COUNT = PRIORITY_LOW + 1;
+    // the priority and deadline are taken into account the next time the task gets signaled or yields.
+    Priority getPriority() const { return m_priority; }
+    void setPriority(Priority priority) { m_priority = priority; }
+    // absolute time, in the ev_now() referential, or 0 for none; within the same priority, tasks with the closest deadline run first.
+    ev_tstamp getDeadline() const { return m_deadline; }
+    void setDeadline(ev_tstamp deadline) { m_deadline = deadline; }
     static Task * getCurrentTask();
     static void prepare(Events::BaseEvent * evt) {
         Task * t = getCurrentTask();
@@ -195,6 +262,8 @@ class Task {
         }
     }
     virtual void Do() = 0;
+    // size of the coroutine stack this task gets; override for tasks needing more or less than the default.
+    virtual size_t stackSize() const { return 64 * 1024; }
     void waitFor(Events::BaseEvent * event);
     void sleep(double timeout);
     bool setOkayToEAgain(bool enable) {
@@ -220,7 +289,6 @@ class Task {
         }
     }
     bool yield(bool stillRunning);
-    static size_t stackSize() { return 64 * 1024; }
     void setup(TaskMan * taskMan, void * stack);
     static bool needsStacks();
     void switchTo();
@@ -245,17 +313,27 @@ class Task {
         }
     }
     void * m_stack = NULL;
+    size_t m_stackSize = 0;
 #ifdef _WIN32
     void * m_fiber = NULL;
 #elif defined(__APPLE__)
     jmp_buf m_ctx;
+#elif defined(BALAU_ASM_CONTEXT)
+    void * m_sp = NULL;
 #else
     ucontext_t m_ctx;
 #endif
     TaskMan * m_taskMan = NULL;
     Status m_status = STARTING;
+    Priority m_priority = PRIORITY_NORMAL;
+    ev_tstamp m_deadline = 0;
+    ev_tstamp m_readySince = 0;
     void * m_tls = NULL;
+    TaskLink m_runLink, m_allLink;
+    // async operations we created and which haven't called done() yet; canceled when we go away.
+    AsyncOperation * m_asyncOps = NULL;
     friend class TaskMan;
+    friend class AsyncOperation;
     friend class Events::TaskEvent;
     Lock m_eventLock;
     typedef std::list<Events::TaskEvent *> waitedByList_t;
@@ -265,27 +343,141 @@ class Task {
     Task & operator=(const Task &) = delete;
 };
 
+template<TaskLink Task::*link>
+class TaskList {
+  public:
+      TaskList() { }
+    bool empty() const { return !m_head; }
+    size_t size() const { return m_size; }
+    Task * front() const { return m_head; }
+    static Task * next(Task * t) { return (t->*link).m_next; }
+    bool contains(const Task * t) const { return (t->*link).m_owner == this; }
+    static bool linked(const Task * t) { return (t->*link).m_owner != NULL; }
+    // inserts t right before pos, or at the end if pos is NULL
+    void insertBefore(Task * pos, Task * t) {
+        if (!pos) {
+            pushBack(t);
+            return;
+        }
+        TaskLink & l = t->*link;
+        TaskLink & p = pos->*link;
+        IAssert(!l.m_owner, "Task at %p is already in a list", t);
+        IAssert(p.m_owner == this, "Task at %p isn't in the list at %p", pos, this);
+        l.m_owner = this;
+        l.m_prev = p.m_prev;
+        l.m_next = pos;
+        if (p.m_prev)
+            (p.m_prev->*link).m_next = t;
+        else
+            m_head = t;
+        p.m_prev = t;
+        m_size++;
+    }
+    void pushBack(Task * t) {
+        TaskLink & l = t->*link;
+        IAssert(!l.m_owner, "Task at %p is already in a list", t);
+        l.m_owner = this;
+        l.m_prev = m_tail;
+        l.m_next = NULL;
+        if (m_tail)
+            (m_tail->*link).m_next = t;
+        else
+            m_head = t;
+        m_tail = t;
+        m_size++;
+    }
+    void remove(Task * t) {
+        TaskLink & l = t->*link;
+        IAssert(l.m_owner == this, "Task at %p isn't in the list at %p", t, this);
+        if (l.m_prev)
+            (l.m_prev->*link).m_next = l.m_next;
+        else
+            m_head = l.m_next;
+        if (l.m_next)
+            (l.m_next->*link).m_prev = l.m_prev;
+        else
+            m_tail = l.m_prev;
+        l.m_prev = l.m_next = NULL;
+        l.m_owner = NULL;
+        m_size--;
+    }
+    Task * popFront() {
+        Task * t = m_head;
+        if (t)
+            remove(t);
+        return t;
+    }
+    // moves all of the tasks of 'other' at the end of this list; still has to walk 'other' to re-own the tasks.
+    void splice(TaskList & other) {
+        if (other.empty())
+            return;
+        for (Task * t = other.m_head; t; t = (t->*link).m_next)
+            (t->*link).m_owner = this;
+        if (m_tail) {
+            (m_tail->*link).m_next = other.m_head;
+            (other.m_head->*link).m_prev = m_tail;
+        } else {
+            m_head = other.m_head;
+        }
+        m_tail = other.m_tail;
+        m_size += other.m_size;
+        other.m_head = other.m_tail = NULL;
+        other.m_size = 0;
+    }
+  private:
+    Task * m_head = NULL, * m_tail = NULL;
+    size_t m_size = 0;
+      TaskList(const TaskList &) = delete;
+    TaskList & operator=(const TaskList &) = delete;
+};
+
+// Multiple producers, single consumer at a time: pushing is a lock-free exchange (Vyukov's intrusive MPSC queue),
+// while consumers are serialized with a lock, so that several threads can still safely pop from the same queue.
+// A producer still touches the queue to wake up the consumer after its node got published, and that node may
+// already have been popped by then; destroying a queue waits for all of the pushes in flight to be done with it.
 class QueueBase {
   public:
-    bool isEmpty() { ScopeLock sl(m_lock); return !m_front; }
+    bool isEmpty() { return m_count.load() == 0; }
+    int size() { return m_count.load(); }
   protected:
-      QueueBase() { pthread_cond_init(&m_cond, NULL); }
-      ~QueueBase() { while (!isEmpty()) iPop(NULL, false); pthread_cond_destroy(&m_cond); }
-    void iPush(void * t, Events::Async * event);
-    void * iPop(Events::Async * event, bool wait);
+      QueueBase() : m_head(&m_stub), m_tail(&m_stub), m_count(0), m_waiters(0), m_pushing(0) { pthread_cond_init(&m_cond, NULL); }
+      ~QueueBase() { waitForProducers(); pthread_cond_destroy(&m_cond); }
+    // has to be called first thing by the derived destructors, before their own members (the event) go away
+    void waitForProducers();
+    // returns true if the queue was empty before that push
+    bool iPush(QueueNode * node, Events::Async * event);
+    QueueNode * iPop(Events::Async * event, bool wait);
+
+    struct Cell : public QueueNode {
+          Cell(void * elem) : m_elem(elem) { }
+        void * m_elem;
+    };
+    template<class T>
+    static QueueNode * toNode(T * t, std::true_type) { return t; }
+    template<class T>
+    static QueueNode * toNode(T * t, std::false_type) { return new Cell(t); }
+    template<class T>
+    static T * fromNode(QueueNode * node, std::true_type) { return static_cast<T *>(node); }
+    template<class T>
+    static T * fromNode(QueueNode * node, std::false_type) {
+        if (!node)
+            return NULL;
+        Cell * c = static_cast<Cell *>(node);
+        T * t = (T *) c->m_elem;
+        delete c;
+        return t;
+    }
 
   private:
       QueueBase(const QueueBase &) = delete;
     QueueBase & operator=(const QueueBase &) = delete;
+    void link(QueueNode * node);
+    QueueNode * unlink();
+    QueueNode m_stub;
+    std::atomic<QueueNode *> m_head;
+    QueueNode * m_tail;
+    std::atomic<int> m_count, m_waiters, m_pushing;
     Lock m_lock;
-    struct Cell {
-          Cell(void * elem) : m_elem(elem) { }
-          Cell(const Cell &) = delete;
-        Cell & operator=(const Cell &) = delete;
-        Cell * m_next = NULL, * m_prev = NULL;
-        void * m_elem;
-    };
-    Cell * m_front = NULL, * m_back = NULL;
     pthread_cond_t m_cond;
 };
 
@@ -340,15 +532,17 @@ void Future<R>::run() {
 template<class T>
 class Queue : public QueueBase {
   public:
-    void push(T * t) { iPush(t, NULL); }
-    T * pop() { return (T *) iPop(NULL, true); }
+      ~Queue() { waitForProducers(); while (!isEmpty()) fromNode<T>(iPop(NULL, false), std::is_base_of<QueueNode, T>()); }
+    bool push(T * t) { return iPush(toNode(t, std::is_base_of<QueueNode, T>()), NULL); }
+    T * pop() { return fromNode<T>(iPop(NULL, true), std::is_base_of<QueueNode, T>()); }
 };
 
 template<class T>
 class TQueue : public QueueBase {
   public:
-    void push(T * t) { iPush(t, &m_event); }
-    T * pop() { return (T *) iPop(&m_event, true); }
+      ~TQueue() { waitForProducers(); while (!isEmpty()) fromNode<T>(iPop(NULL, false), std::is_base_of<QueueNode, T>()); }
+    bool push(T * t) { return iPush(toNode(t, std::is_base_of<QueueNode, T>()), &m_event); }
+    T * pop() { return fromNode<T>(iPop(&m_event, true), std::is_base_of<QueueNode, T>()); }
     Events::Async * getEvent() { return &m_event; }
   private:
     Events::Async m_event;
@@ -357,8 +551,9 @@ class TQueue : public QueueBase {
 template<class T>
 class CQueue : public QueueBase {
   public:
-    void push(T * t) { iPush(t, NULL); }
-    T * pop() { return (T *) iPop(NULL, false); }
+      ~CQueue() { waitForProducers(); while (!isEmpty()) fromNode<T>(iPop(NULL, false), std::is_base_of<QueueNode, T>()); }
+    bool push(T * t) { return iPush(toNode(t, std::is_base_of<QueueNode, T>()), NULL); }
+    T * pop() { return fromNode<T>(iPop(NULL, false), std::is_base_of<QueueNode, T>()); }
 };
 
 };
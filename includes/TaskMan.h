@@ -15,10 +15,15 @@
 #include <ext/hash_set>
 #endif
 #include <queue>
+#include <deque>
+#include <map>
+#include <vector>
+#include <typeindex>
 #include <Async.h>
 #include <Threads.h>
 #include <Exceptions.h>
 #include <Task.h>
+#include <TimerWheel.h>
 
 #ifndef _MSC_VER
 namespace gnu = __gnu_cxx;
@@ -30,6 +35,7 @@ namespace Balau {
 
 class TaskScheduler;
 class CurlTask;
+class IoUring;
 
 namespace Events {
 
@@ -44,8 +50,17 @@ class TaskMan {
           virtual ~TaskManThread();
         virtual void * proc();
         void stopMe(int code = 0) { m_taskMan->stopMe(code); }
+        // waits for the thread's TaskMan to be created; NULL if that failed. Only call it from one thread. From a task,
+        // only that task waits, not the TaskMan it runs on.
+        TaskMan * getTaskMan();
       private:
         TaskMan * m_taskMan = NULL;
+        // the CPUs the thread gets pinned to before creating its TaskMan; empty means no pinning.
+        std::vector<int> m_cpus;
+        TQueue<TaskMan> m_created;
+        TaskMan * m_createdTaskMan = NULL;
+        bool m_gotCreated = false;
+        friend class TaskMan;
     };
 
       TaskMan();
@@ -53,34 +68,103 @@ class TaskMan {
     int mainLoop();
     static TaskMan * getDefaultTaskMan();
     struct ev_loop * getLoop() { return m_loop; }
+    TimerWheel * getTimerWheel() { return m_timerWheel; }
+    // set up on first use; NULL if the kernel can't do io_uring, in which case file operations use the async threads.
+    IoUring * getIoUring();
+    // false sends this TaskMan's file operations to the async threads, as if it had no ring.
+    void useIoUring(bool use) { m_useIoUring = use; }
     void signalTask(Task * t);
     static void stop(int code);
     void stopMe(int code = 0);
-    static TaskManThread * createThreadedTaskMan() {
+    // cpu >= 0 pins the thread to that CPU
+    static TaskManThread * createThreadedTaskMan(int cpu = -1) {
         TaskManThread * r = new TaskManThread();
+        if (cpu >= 0)
+            r->m_cpus.push_back(cpu);
         r->threadStart();
         return r;
     }
+    // pins the thread to all of the CPUs of that NUMA node
+    static TaskManThread * createThreadedTaskManOnNode(int node) {
+        TaskManThread * r = new TaskManThread();
+        r->m_cpus = getNodeCPUs(node);
+        r->threadStart();
+        return r;
+    }
+    static std::vector<int> getNodeCPUs(int node);
     static void stopThreadedTaskMan(TaskManThread * tmt) {
         tmt->stopMe(0);
         tmt->join();
         delete tmt;
     }
     bool stopped() { return m_stopped; }
+    // the longest time low priority yielded tasks can be left aside while higher priority tasks keep us busy.
+    void setMaxStarvation(ev_tstamp maxStarvation) { m_maxStarvation = maxStarvation; }
+    struct StackPoolStats {
+        size_t stackSize;
+        int inUse;      // stacks currently given to tasks
+        int pooled;     // stacks kept around for reuse
+        int resident;   // pooled stacks that haven't been trimmed
+    };
+    // one entry per stack size this TaskMan ever handed out
+    std::vector<StackPoolStats> getStackPoolStats();
+    // Per task class accounting, across all TaskMans. Disabled by default, since it costs a clock read per switch.
+    static const int LATENCY_BUCKETS = 24;
+    struct TaskStats {
+        String className;
+        uint64_t switches = 0;
+        ev_tstamp runTime = 0;
+        // time between a task being ready to run (started, signaled or yielded) and being switched to;
+        // bucket 0 is under 1us, bucket i is [2^(i-1), 2^i[ us, and the last one holds everything above.
+        uint64_t latencies[LATENCY_BUCKETS] = { 0 };
+    };
+    static void enableTaskStats(bool enable);
+    static std::vector<TaskStats> getTaskStats();
+    // idle TaskMans taking over tasks still waiting to start on busier ones, across all TaskMans
+    struct SchedulerStats {
+        uint64_t steals = 0;        // steals that got at least one task
+        uint64_t stolenTasks = 0;
+    };
+    static SchedulerStats getSchedulerStats();
+    // Sizes the pool of threads running async main queue operations; operations on the same fd stay ordered.
+    static void setAsyncWorkers(int n);
+    static void setAsyncFinishers(int minIdle, int maxIdle);
+    static void setAsyncFinishersTarget(int maxFinishers, ev_tstamp targetWait);
+    static AsyncFinisherStats getAsyncFinisherStats();
+    // one entry per async main queue worker
+    static std::vector<AsyncStats> getAsyncStats();
+    int getLoad() { return m_load.load(std::memory_order_relaxed); }
     template<class T>
     static T * registerTask(T * t, Task * stick = NULL) { TaskMan::iRegisterTask(t, stick, NULL); return t; }
     template<class T>
     static T * registerTask(T * t, Events::TaskEvent * event) { TaskMan::iRegisterTask(t, NULL, event); return t; }
+    // runs the task on that specific TaskMan; it won't be moved to another one.
+    template<class T>
+    static T * registerTask(T * t, TaskMan * taskMan, Events::TaskEvent * event = NULL) { TaskMan::iRegisterTask(t, NULL, event, taskMan); return t; }
 
     typedef std::function<void(int status, int timeouts, struct hostent * hostent)> AresHostCallback;
     void getHostByName(const Balau::String & name, int family, AresHostCallback callback);
 
   private:
-    static void iRegisterTask(Task * t, Task * stick, Events::TaskEvent * event);
+    typedef TaskList<&Task::m_runLink> runList_t;
+    typedef TaskList<&Task::m_allLink> allList_t;
+    static void iRegisterTask(Task * t, Task * stick, Events::TaskEvent * event, TaskMan * taskMan = NULL);
     static void registerAsyncOp(AsyncOperation * op);
-    void * getStack();
-    void freeStack(void * stack);
+    void setupTask(Task * t);
+    void enqueue(runList_t * lists, Task * t);
+    void runTask(Task * t);
+    void collectTaskStats(std::map<std::type_index, TaskStats> & stats);
+    bool hasYieldedTasks();
+    void * getStack(size_t size);
+    void freeStack(void * stack, size_t size);
     void addToPending(Task * t);
+    void postSignal(Events::BaseEvent * e);
+    void cancelSignal(Events::BaseEvent * e);
+    void drainInbox();
+    void pushStarting(Task * t);
+    Task * popStarting();
+    int stealFrom(TaskMan * victim);
+    size_t startingSize() { ScopeLock sl(m_startingLock); return m_starting.size(); }
     static void asyncIdleReady(void * param) {
         TaskMan * taskMan = (TaskMan *) param;
         taskMan->asyncIdleReady();
@@ -88,7 +172,9 @@ class TaskMan {
     void asyncIdleReady() {
         m_evt.send();
     }
-#if defined(__linux)
+#if defined(BALAU_ASM_CONTEXT)
+    void * m_returnSP = NULL;
+#elif defined(__linux)
     ucontext_t m_returnContext;
 #elif defined (_WIN32)
     void * m_fiber;
@@ -96,6 +182,7 @@ class TaskMan {
     jmp_buf m_returnContext;
 #endif
     friend class Task;
+    friend class Events::BaseEvent;
     friend class CurlTask;
     friend class TaskScheduler;
     template<class T>
@@ -106,12 +193,37 @@ class TaskMan {
     struct taskHasher { size_t operator()(const Task * t) const { return reinterpret_cast<uintptr_t>(t); } };
     typedef gnu::hash_set<Task *, taskHasher> taskHash_t;
 #endif
-    taskHash_t m_tasks, m_signaledTasks;
+    allList_t m_tasks;
+    // a task sits in at most one of these at a time; m_startingTasks are set up, but never ran yet.
+    runList_t m_startingTasks, m_stoppedTasks;
+    // one per priority
+    runList_t m_signaledTasks[Task::PRIORITY_COUNT], m_yieldedTasks[Task::PRIORITY_COUNT];
+    std::map<std::type_index, TaskStats> m_taskStats;
+    Lock m_taskStatsLock;
+    ev_tstamp m_maxStarvation = 0.05;
+    ev_tstamp m_lowPriorityLastRun = 0;
     Queue<Task> m_pendingAdd;
+    // events signaled from other threads; swapped out and signaled once per loop, with a single wakeup per batch.
+    // Both are protected by m_inboxLock.
+    std::vector<Events::BaseEvent *> m_inbox, m_inboxDraining;
+    Lock m_inboxLock;
+    // tasks that haven't been set up yet; other TaskMans may steal from the back
+    std::deque<Task *> m_starting;
+    Lock m_startingLock;
+    std::atomic<int> m_load;
+    std::atomic<bool> m_idle;
     struct ev_loop * m_loop;
+    TimerWheel * m_timerWheel = NULL;
+    IoUring * m_ioUring = NULL;
+    bool m_ioUringProbed = false, m_useIoUring = true;
     ev::async m_evt;
-    std::queue<void *> m_stacks;
-    int m_nStacks;
+    struct StackBucket {
+        std::vector<void *> stacks;
+        int inUse = 0;
+    };
+    // keyed by stack size, guard page excluded
+    std::map<size_t, StackBucket> m_stacks;
+    Lock m_stacksLock;
     int m_stopCode = 0;
     bool m_stopped = false;
     bool m_allowedToSignal = false;
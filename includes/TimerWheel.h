@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <ev++.h>
+
+namespace Balau {
+
+namespace Events { class CoarseTimeout; };
+
+// Hierarchical timing wheel, one per TaskMan, driven by a single libev timer that only runs while the wheel
+// holds timeouts. Adding and removing a timeout is O(1); the price is a TICK granularity, and timeouts never
+// fire early, but may fire up to one tick late. The timer isn't ticking all the time; it sleeps until the next
+// root slot holding timeouts, or until the root wheel wraps around and pulls the next ones down, whichever is first.
+class TimerWheel {
+  public:
+    static constexpr ev_tstamp TICK = 0.01;
+      TimerWheel(struct ev_loop * loop);
+      ~TimerWheel();
+    void add(Events::CoarseTimeout * t, ev_tstamp delay);
+    void remove(Events::CoarseTimeout * t);
+    int size() { return m_count; }
+    uint64_t currentTick() { return uint64_t(ev_now(m_loop) / TICK); }
+    // fires everything due up to that tick, as if the clock got there; the libev timer drives that normally.
+    void advance(uint64_t tick);
+  private:
+      TimerWheel(const TimerWheel &) = delete;
+    TimerWheel & operator=(const TimerWheel &) = delete;
+    static const int ROOT_BITS = 8;
+    static const int LEVEL_BITS = 6;
+    static const int LEVELS = 4;
+    static const int ROOT_SIZE = 1 << ROOT_BITS;
+    static const int LEVEL_SIZE = 1 << LEVEL_BITS;
+    static const uint64_t MAX_DELTA = (uint64_t(1) << (ROOT_BITS + (LEVELS - 1) * LEVEL_BITS)) - 1;
+    void insert(Events::CoarseTimeout * t);
+    void cascade(int level, int idx);
+    void step();
+    uint64_t nextTick();
+    void arm();
+    void evt_cb(ev::timer & w, int revents);
+    Events::CoarseTimeout * m_root[ROOT_SIZE];
+    Events::CoarseTimeout * m_levels[LEVELS - 1][LEVEL_SIZE];
+    uint64_t m_now;
+    // the tick the timer is set to wake us up at
+    uint64_t m_armedFor = 0;
+    int m_count = 0;
+    struct ev_loop * m_loop;
+    ev::timer m_timer;
+};
+
+};
@@ -26,9 +26,15 @@ class ZStream : public Filter {
     void finish() { doFlush(true); }
     void doFlush(bool finish);
   private:
+    void abandonAsyncOp();
+    // our buffers come from the IOBufferPool, and only while there's data going through them. Reads and writes
+    // each have their own: compressed input left over by a read has to survive a write in between.
+    void acquireBuf(uint8_t * & buf, size_t & bufSize, size_t size);
+    void releaseBuf(uint8_t * & buf, size_t bufSize);
     z_stream m_zin, m_zout;
     String m_name;
-    uint8_t * m_buf = NULL;
+    uint8_t * m_inBuf = NULL, * m_outBuf = NULL;
+    size_t m_inBufSize = 0, m_outBufSize = 0;
     uint8_t * m_wptr;
     enum {
         IDLE,
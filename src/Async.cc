@@ -1,4 +1,11 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include <algorithm>
 #include "Async.h"
+#include "TaskMan.h"
 
 namespace {
 
@@ -8,10 +15,17 @@ class AsyncStopper : public Balau::AsyncOperation {
     virtual void done() { delete this; }
 };
 
+// wakes the manager up so it can look at the finishers pool again.
+class AsyncTick : public Balau::AsyncOperation {
+  public:
+    virtual bool needsSynchronousCallback() { return false; }
+    virtual void done() { delete this; }
+};
+
 };
 
 void Balau::AsyncManager::setIdleReadyCallback(void (*callback)(void *), void * param) {
-    while (!m_ready);
+    waitReady();
     TLS * tls = getTLS();
     tls->idleReadyCallback = callback;
     tls->idleReadyParam = param;
@@ -20,11 +34,12 @@ void Balau::AsyncManager::setIdleReadyCallback(void (*callback)(void *), void *
 void Balau::AsyncManager::queueOp(AsyncOperation * op) {
     if (m_stopperPushed) {
         Printer::elog(E_ASYNC, "AsyncManager's queue has been stopped; running operation %p on this thread instead.", op);
-        op->run();
+        if (op->startRunning())
+            op->run();
         op->finalize();
         return;
     }
-    while (!m_ready);
+    waitReady();
     TLS * tls = getTLS();
     Printer::elog(E_ASYNC, "Queuing operation at %p", op);
     if (op->needsSynchronousCallback()) {
@@ -32,56 +47,205 @@ void Balau::AsyncManager::queueOp(AsyncOperation * op) {
         op->m_idleQueue = &tls->idleQueue;
         op->m_idleReadyCallback = tls->idleReadyCallback;
         op->m_idleReadyParam = tls->idleReadyParam;
+        Task * t = Task::getCurrentTask();
+        if (t)
+            op->attachToTask(t);
     }
     if (op->needsMainQueue()) {
-        m_queue.push(op);
+        int n = m_numMainWorkers.load(std::memory_order_acquire);
+        intptr_t key = op->orderingKey();
+        AsyncMainWorker * worker;
+        if (key >= 0) {
+            op->m_routedKey = key;
+            worker = routeKey(key, n);
+        } else {
+            // unordered operations go to the shortest queue, starting from a rotating point to spread ties.
+            unsigned start = m_nextMainWorker++;
+            worker = m_mainWorkers[start % n];
+            for (int i = 1; (i < n) && (worker->m_queue.size() != 0); i++) {
+                AsyncMainWorker * other = m_mainWorkers[(start + i) % n];
+                if (other->m_queue.size() < worker->m_queue.size())
+                    worker = other;
+            }
+        }
+        Printer::elog(E_ASYNC, "Operation at %p goes to main worker %p", op, worker);
+        op->m_queuedAt = ev_time();
+        worker->m_queue.push(op);
     } else if (op->needsFinishWorker()) {
-        m_finished.push(op);
+        queueFinish(op);
     } else {
-        op->run();
+        if (op->startRunning())
+            op->run();
         op->finalize();
     }
 }
 
+Balau::AsyncManager::~AsyncManager() {
+    for (int i = 0; i < m_startedMainWorkers; i++)
+        delete m_mainWorkers[i];
+    pthread_cond_destroy(&m_stateCond);
+    pthread_mutex_destroy(&m_stateLock);
+}
+
+void Balau::AsyncManager::setMainWorkers(int n) {
+    AAssert(n >= 1 && n <= MAX_MAIN_WORKERS, "The number of main workers needs to be between 1 and %i.", MAX_MAIN_WORKERS);
+    ScopeLock sl(m_mainWorkersLock);
+    m_wantedMainWorkers = n;
+    if (m_ready)
+        startMainWorkers();
+}
+
+// called with m_mainWorkersLock held
+void Balau::AsyncManager::startMainWorkers() {
+    while (m_startedMainWorkers < m_wantedMainWorkers) {
+        AsyncMainWorker * worker = new AsyncMainWorker(this);
+        Printer::elog(E_ASYNC, "Starting main worker #%i at %p", m_startedMainWorkers, worker);
+        worker->threadStart();
+        m_mainWorkers[m_startedMainWorkers++] = worker;
+    }
+    m_numMainWorkers.store(m_wantedMainWorkers, std::memory_order_release);
+}
+
+// a key keeps its worker for as long as it has operations queued or running there; after that, it goes wherever
+// the current number of workers puts it.
+Balau::AsyncMainWorker * Balau::AsyncManager::routeKey(intptr_t key, int n) {
+    RouteStripe & stripe = m_routes[key % ROUTE_STRIPES];
+    ScopeLock sl(stripe.lock);
+    auto i = stripe.routes.find(key);
+    if (i != stripe.routes.end()) {
+        i->second.inFlight++;
+        return i->second.worker;
+    }
+    AsyncMainWorker * worker = m_mainWorkers[key % n];
+    stripe.routes[key] = { worker, 1 };
+    return worker;
+}
+
+// called by the worker once the operation ran, or got skipped
+void Balau::AsyncManager::unrouteKey(intptr_t key) {
+    RouteStripe & stripe = m_routes[key % ROUTE_STRIPES];
+    ScopeLock sl(stripe.lock);
+    auto i = stripe.routes.find(key);
+    IAssert(i != stripe.routes.end(), "Key %" PRIiPTR " isn't routed", key);
+    if (--i->second.inFlight == 0)
+        stripe.routes.erase(i);
+}
+
+std::vector<Balau::AsyncStats> Balau::AsyncManager::getStats() {
+    std::vector<AsyncStats> r;
+    int n = m_numMainWorkers.load(std::memory_order_acquire);
+    for (int i = 0; i < n; i++)
+        r.push_back(m_mainWorkers[i]->getStats());
+    return r;
+}
+
+void Balau::AsyncManager::tick() {
+    if (m_stopperPushed || m_tickPushed.exchange(true))
+        return;
+    m_queue.push(new AsyncTick());
+}
+
+int Balau::AsyncManager::getCPUCount() {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+#endif
+}
+
 void Balau::AsyncManager::checkIdle() {
-    if (m_numFinishersIdle > m_maxIdle)
-        killOneFinisher();
-    if (m_numFinishersIdle < m_minIdle)
+    int maxFinishers = std::max(m_maxFinishers.load(), m_minIdle.load());
+    if (m_growRequested.exchange(false) && (m_numFinishersIdle == 0)) {
+        // operations are piling up; start enough finishers to take the whole backlog at once.
+        int n = std::min(std::max(m_finished.size(), 1), maxFinishers - m_numFinishers);
+        Printer::elog(E_ASYNC, "Finishers queue is too slow (%i waiting), starting %i more finishers", m_finished.size(), n);
+        for (int i = 0; i < n; i++)
+            startOneFinisher();
+    } else {
+        // stoppers already on their way will take some of the idle ones down as well.
+        int extra = m_numFinishersIdle - m_pendingStoppers - m_maxIdle;
+        if (extra > 0)
+            killFinishers(extra);
+    }
+    if ((m_numFinishersIdle < m_minIdle) && (m_numFinishers < maxFinishers))
         startOneFinisher();
     joinStoppedFinishers();
 }
 
-void Balau::AsyncManager::killOneFinisher() {
-    Printer::elog(E_ASYNC, "Too many workers idle (%i / %i), killing one.", m_numFinishersIdle, m_maxIdle);
-    m_finished.push(new AsyncStopper());
+void Balau::AsyncManager::finisherGotOp(ev_tstamp idle, ev_tstamp wait) {
+    bool grow;
+    {
+        ScopeLock sl(m_finisherStatsLock);
+        AsyncFinisherStats & stats = m_finisherStats;
+        stats.ops++;
+        stats.totalIdle += idle;
+        stats.totalWait += wait;
+        if (wait > stats.maxWait)
+            stats.maxWait = wait;
+        stats.avgWait += (wait - stats.avgWait) / 8;
+        grow = stats.avgWait > m_targetWait;
+    }
+    if (grow && (m_numFinishersIdle == 0) && (m_numFinishers < m_maxFinishers) && !m_growRequested.exchange(true))
+        tick();
+}
+
+Balau::AsyncFinisherStats Balau::AsyncManager::getFinisherStats() {
+    ScopeLock sl(m_finisherStatsLock);
+    AsyncFinisherStats r = m_finisherStats;
+    r.finishers = m_numFinishers;
+    r.idle = m_numFinishersIdle;
+    r.maxFinishers = std::max(m_maxFinishers.load(), m_minIdle.load());
+    return r;
+}
+
+void Balau::AsyncManager::killFinishers(int n) {
+    Printer::elog(E_ASYNC, "Too many workers idle (%i / %i), killing %i.", m_numFinishersIdle.load(), m_maxIdle.load(), n);
+    m_pendingStoppers += n;
+    for (int i = 0; i < n; i++)
+        m_finished.push(new AsyncStopper());
+    ScopeLock sl(m_finisherStatsLock);
+    m_finisherStats.shrunk += n;
 }
 
 void Balau::AsyncManager::startOneFinisher() {
     AsyncFinishWorker * worker = new AsyncFinishWorker(this, &m_finished);
-    Printer::elog(E_ASYNC, "Not enough workers idle (%i / %i), starting one at %p.", m_numFinishersIdle, m_minIdle, worker);
+    Printer::elog(E_ASYNC, "Not enough workers idle (%i / %i), starting one at %p.", m_numFinishersIdle.load(), m_minIdle.load(), worker);
     m_workers.push_back(worker);
     m_numFinishers++;
     worker->threadStart();
+    ScopeLock sl(m_finisherStatsLock);
+    m_finisherStats.grown++;
 }
 
 void Balau::AsyncManager::joinStoppedFinishers() {
-    for (auto i = m_workers.begin(); i != m_workers.end(); i++) {
+    for (auto i = m_workers.begin(); i != m_workers.end();) {
         AsyncFinishWorker * worker = *i;
-        if (!worker->stopped())
+        if (!worker->stopped()) {
+            i++;
             continue;
+        }
         Printer::elog(E_ASYNC, "Joining stopped worker at %p", worker);
         m_numFinishers--;
-        m_workers.erase(i);
+        i = m_workers.erase(i);
         worker->join();
         delete worker;
-        break;
     }
 }
 
 void * Balau::AsyncManager::proc() {
     Printer::elog(E_ASYNC, "AsyncManager thread starting up");
     m_tlsManager.init();
+    {
+        ScopeLock sl(m_mainWorkersLock);
+        startMainWorkers();
+    }
+    pthread_mutex_lock(&m_stateLock);
     m_ready = true;
+    pthread_cond_broadcast(&m_stateCond);
+    pthread_mutex_unlock(&m_stateLock);
     while (!m_stopping) {
         checkIdle();
         AsyncOperation * op = m_queue.pop();
@@ -89,33 +253,74 @@ void * Balau::AsyncManager::proc() {
         if (dynamic_cast<AsyncStopper *>(op)) {
             Printer::elog(E_ASYNC, "AsyncManager got a stopper operation");
             m_stopping = true;
+        } else if (dynamic_cast<AsyncTick *>(op)) {
+            m_tickPushed = false;
+        }
+        op->finalize();
+    }
+    stopAllWorkers();
+
+    waitIdleQueuesDrained();
+
+    Printer::elog(E_ASYNC, "Async thread stopping");
+    return NULL;
+}
+
+void * Balau::AsyncMainWorker::proc() {
+    Printer::elog(E_ASYNC, "AsyncMainWorker thread starting up");
+    bool stopping = false;
+    while (!stopping) {
+        AsyncOperation * op = m_queue.pop();
+        Printer::elog(E_ASYNC, "AsyncMainWorker got operation at %p", op);
+        if (dynamic_cast<AsyncStopper *>(op)) {
+            Printer::elog(E_ASYNC, "AsyncMainWorker got a stopper operation");
+            stopping = true;
+        }
+        ev_tstamp start = ev_time();
+        if (op->startRunning())
+            op->run();
+        else
+            Printer::elog(E_ASYNC, "AsyncMainWorker skipping canceled operation at %p", op);
+        ev_tstamp end = ev_time();
+        // the next operations on that key may go elsewhere once this was the last one; it's done running anyway.
+        if (op->m_routedKey >= 0)
+            m_async->unrouteKey(op->m_routedKey);
+        {
+            ScopeLock sl(m_statsLock);
+            ev_tstamp wait = start - op->m_queuedAt, run = end - start;
+            m_stats.ops++;
+            m_stats.totalWait += wait;
+            m_stats.totalRun += run;
+            if (wait > m_stats.maxWait)
+                m_stats.maxWait = wait;
+            if (run > m_stats.maxRun)
+                m_stats.maxRun = run;
         }
-        Printer::elog(E_ASYNC, "AsyncManager running operation at %p", op);
-        op->run();
         if (op->needsFinishWorker()) {
-            Printer::elog(E_ASYNC, "AsyncManager pushing operation at %p in the finisher's queue", op);
-            m_finished.push(op);
+            Printer::elog(E_ASYNC, "AsyncMainWorker pushing operation at %p in the finisher's queue", op);
+            m_async->queueFinish(op);
         } else {
-            Printer::elog(E_ASYNC, "AsyncManager finalizing operation at %p", op);
+            Printer::elog(E_ASYNC, "AsyncMainWorker finalizing operation at %p", op);
             op->finalize();
         }
     }
-    stopAllWorkers();
-
-    Printer::elog(E_ASYNC, "Async thread waits for all idle queues to empty");
-    while (m_numTLSes--) {
-        TLS * tls = m_TLSes.pop();
-        while (!tls->idleQueue.isEmpty());
-    }
 
-    Printer::elog(E_ASYNC, "Async thread stopping");
+    Printer::elog(E_ASYNC, "AsyncMainWorker thread stopping");
     return NULL;
 }
 
+Balau::AsyncStats Balau::AsyncMainWorker::getStats() {
+    ScopeLock sl(m_statsLock);
+    AsyncStats r = m_stats;
+    r.queueDepth = m_queue.size();
+    return r;
+}
+
 void * Balau::AsyncFinishWorker::proc() {
     Printer::elog(E_ASYNC, "AsyncFinishWorker thread starting up");
     AsyncOperation * op;
     while (!m_stopping) {
+        ev_tstamp idleSince = ev_time();
         m_async->incIdle();
         op = m_queue->pop();
         m_async->decIdle();
@@ -123,25 +328,59 @@ void * Balau::AsyncFinishWorker::proc() {
         if (dynamic_cast<AsyncStopper *>(op)) {
             Printer::elog(E_ASYNC, "AsyncFinishWorker got a stopper operation");
             m_stopping = true;
+            m_async->m_pendingStoppers--;
+        } else {
+            ev_tstamp now = ev_time();
+            m_async->finisherGotOp(now - idleSince, now - op->m_queuedAt);
         }
-        if (!op->needsMainQueue())
+        if (!op->needsMainQueue() && op->startRunning())
             op->run();
         op->finalize();
     }
 
     m_stopped = true;
+    // so the manager joins us, and takes another look at the pool now that we're gone.
+    m_async->tick();
     Printer::elog(E_ASYNC, "AsyncFinishWorker thread stopping");
 
     return NULL;
 }
 
+void Balau::AsyncOperation::cancel() {
+    Printer::elog(E_ASYNC, "Canceling operation %p", this);
+    m_canceled = true;
+    int expected = QUEUED;
+    m_state.compare_exchange_strong(expected, SKIPPED);
+}
+
+void Balau::AsyncOperation::attachToTask(Task * task) {
+    m_task = task;
+    m_taskPrev = NULL;
+    m_taskNext = task->m_asyncOps;
+    if (m_taskNext)
+        m_taskNext->m_taskPrev = this;
+    task->m_asyncOps = this;
+}
+
+void Balau::AsyncOperation::detachFromTask() {
+    if (!m_task)
+        return;
+    if (m_taskPrev)
+        m_taskPrev->m_taskNext = m_taskNext;
+    else
+        m_task->m_asyncOps = m_taskNext;
+    if (m_taskNext)
+        m_taskNext->m_taskPrev = m_taskPrev;
+    m_task = NULL;
+    m_taskPrev = m_taskNext = NULL;
+}
+
 void Balau::AsyncOperation::finalize() {
     Printer::elog(E_ASYNC, "AsyncOperation::finalize() is finishing operation %p", this);
     finish();
     if (needsSynchronousCallback()) {
         Printer::elog(E_ASYNC, "AsyncOperation::finalize() is pushing operation %p to its idle queue", this);
-        bool wasEmpty = m_idleQueue->isEmpty();
-        m_idleQueue->push(this);
+        bool wasEmpty = m_idleQueue->push(this);
         Printer::elog(E_ASYNC, "AsyncOperation::finalize() has pushed operation %p to its idle queue; wasEmpty = %s; callback = %p", this, wasEmpty ? "true" : "false", m_idleReadyCallback);
         if (wasEmpty && m_idleReadyCallback) {
             Printer::elog(E_ASYNC, "AsyncOperation::finalize() is calling ready callback to wake up main loop");
@@ -155,13 +394,42 @@ void Balau::AsyncOperation::finalize() {
 
 void Balau::AsyncManager::idle() {
     Printer::elog(E_ASYNC, "AsyncManager::idle() is running");
-    while (!m_ready);
+    waitReady();
     AsyncOperation * op;
     TLS * tls = getTLS();
     while ((op = tls->idleQueue.pop())) {
         Printer::elog(E_ASYNC, "AsyncManager::idle() is wrapping up operation %p", op);
+        op->detachFromTask();
         op->done();
     }
+    if (m_draining) {
+        pthread_mutex_lock(&m_stateLock);
+        pthread_cond_broadcast(&m_stateCond);
+        pthread_mutex_unlock(&m_stateLock);
+    }
+}
+
+void Balau::AsyncManager::waitReady() {
+    if (m_ready)
+        return;
+    pthread_mutex_lock(&m_stateLock);
+    while (!m_ready)
+        pthread_cond_wait(&m_stateCond, &m_stateLock);
+    pthread_mutex_unlock(&m_stateLock);
+}
+
+void Balau::AsyncManager::waitIdleQueuesDrained() {
+    Printer::elog(E_ASYNC, "Async thread waits for all idle queues to empty");
+    // idle() looks at m_draining after emptying its queue, so either it sees it and wakes us up,
+    // or we see its queue empty.
+    m_draining = true;
+    pthread_mutex_lock(&m_stateLock);
+    while (m_numTLSes--) {
+        TLS * tls = m_TLSes.pop();
+        while (!tls->idleQueue.isEmpty())
+            pthread_cond_wait(&m_stateCond, &m_stateLock);
+    }
+    pthread_mutex_unlock(&m_stateLock);
 }
 
 void Balau::AsyncManager::threadExit() {
@@ -171,9 +439,95 @@ void Balau::AsyncManager::threadExit() {
 }
 
 void Balau::AsyncManager::stopAllWorkers() {
-    Printer::elog(E_ASYNC, "AsyncManager thread is stopping and joining %i workers", m_numFinishers);
+    Printer::elog(E_ASYNC, "AsyncManager thread is stopping and joining %i main workers", m_startedMainWorkers);
+    {
+        ScopeLock sl(m_mainWorkersLock);
+        for (int i = 0; i < m_startedMainWorkers; i++)
+            m_mainWorkers[i]->m_queue.push(new AsyncStopper());
+        // the workers themselves stay around until we're destroyed, as a late queueOp() may still route to them.
+        for (int i = 0; i < m_startedMainWorkers; i++)
+            m_mainWorkers[i]->join();
+    }
+    Printer::elog(E_ASYNC, "AsyncManager thread is stopping and joining %i workers", m_numFinishers.load());
     for (int i = 0; i < m_numFinishers; i++)
         m_finished.push(new AsyncStopper());
     for (auto worker : m_workers)
         worker->join();
 }
+
+void Balau::AsyncBatch::add(AsyncOperation * op) {
+    AAssert(!m_submitted, "Can't add to a batch that's been submitted.");
+    intptr_t key = op->orderingKey();
+    if (key >= 0) {
+        AAssert((m_key < 0) || (m_key == key), "Can't mix ordering keys %" PRIiPTR " and %" PRIiPTR " in a batch.", m_key, key);
+        m_key = key;
+    }
+    m_ops.push_back(op);
+}
+
+void Balau::AsyncBatch::submit() {
+    AAssert(!m_submitted, "Can't submit a batch twice.");
+    Task * t = Task::getCurrentTask();
+    AAssert(t, "A batch needs to be submitted from a task.");
+    // the worker may trigger us before we get to wait, so the owner has to be there first.
+    m_anyEvt.registerOwner(t);
+    m_allEvt.registerOwner(t);
+    m_submitted = true;
+    Printer::elog(E_ASYNC, "Submitting batch %p of %zu operations", this, m_ops.size());
+    createAsyncOp(this);
+}
+
+void Balau::AsyncBatch::wait() {
+    if (m_mode == ALL) {
+        waitAll();
+        return;
+    }
+    // a batch canceled before running never gets there, but done() signals us anyway.
+    while ((m_completed.load() == 0) && !m_done)
+        Task::operationYield(&m_anyEvt, Task::INTERRUPTIBLE);
+}
+
+void Balau::AsyncBatch::waitAll() {
+    while (!m_done)
+        Task::operationYield(&m_allEvt, Task::INTERRUPTIBLE);
+}
+
+void Balau::AsyncBatch::run() {
+    for (AsyncOperation * op : m_ops) {
+        if (!op->startRunning())
+            continue;
+        op->run();
+        if ((m_completed++ == 0) && (m_mode == ANY))
+            m_anyEvt.trigger();
+    }
+}
+
+void Balau::AsyncBatch::cancel() {
+    AsyncOperation::cancel();
+    for (AsyncOperation * op : m_ops)
+        op->cancel();
+}
+
+void Balau::AsyncBatch::finish() {
+    for (AsyncOperation * op : m_ops)
+        op->finish();
+}
+
+void Balau::AsyncBatch::done() {
+    Printer::elog(E_ASYNC, "Batch %p is done", this);
+    // operations usually delete themselves there
+    for (AsyncOperation * op : m_ops)
+        op->done();
+    m_ops.clear();
+    m_done = true;
+    m_allEvt.doSignal();
+    if (m_mode == ANY)
+        m_anyEvt.doSignal();
+}
+
+bool Balau::AsyncBatch::needsFinishWorker() {
+    for (AsyncOperation * op : m_ops)
+        if (op->needsFinishWorker())
+            return true;
+    return false;
+}
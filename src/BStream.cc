@@ -1,23 +1,84 @@
 #include "BStream.h"
 #include "Buffer.h"
+#include "IOBufferPool.h"
 
-static const int s_blockSize = 16 * 1024;
+// how many reads in a row it takes for the adaptive mode to change the block size.
+static const int s_adaptThreshold = 4;
 
-Balau::BStream::BStream(IO<Handle> h) : Filter(h), m_buffer((uint8_t *) malloc(s_blockSize)) {
+Balau::BStream::BStream(IO<Handle> h, size_t blockSize) : Filter(h) {
     AAssert(h->canRead(), "You can't create a buffered stream with a Handle that can't read");
     m_name.set("Stream(%s)", h->getName());
     if ((h.isA<Buffer>()) || (h.isA<BStream>()))
         m_passThru = true;
+    setBlockSize(blockSize);
+}
+
+void Balau::BStream::setBlockSize(size_t blockSize) {
+    AAssert((blockSize >= MIN_BLOCK_SIZE) && (blockSize <= MAX_BLOCK_SIZE), "Block size %zu out of range", blockSize);
+    m_blockSize = blockSize;
+}
+
+void Balau::BStream::adapt(size_t got) {
+    if (got == m_blockSize) {
+        m_shortReads = 0;
+        if ((++m_fullReads >= s_adaptThreshold) && (m_blockSize < MAX_BLOCK_SIZE)) {
+            m_blockSize *= 2;
+            if (m_blockSize > MAX_BLOCK_SIZE)
+                m_blockSize = MAX_BLOCK_SIZE;
+            m_fullReads = 0;
+        }
+    } else if (got < m_blockSize / 4) {
+        m_fullReads = 0;
+        if ((++m_shortReads >= s_adaptThreshold) && (m_blockSize > MIN_BLOCK_SIZE)) {
+            m_blockSize /= 2;
+            if (m_blockSize < MIN_BLOCK_SIZE)
+                m_blockSize = MIN_BLOCK_SIZE;
+            m_shortReads = 0;
+        }
+    } else {
+        m_fullReads = m_shortReads = 0;
+    }
 }
 
 void Balau::BStream::close() throw (Balau::GeneralException) {
     Filter::close();
-    free(m_buffer);
-    m_buffer = NULL;
+    releaseBuffer();
     m_availBytes = 0;
     m_cursor = 0;
 }
 
+ssize_t Balau::BStream::fill() {
+    IAssert(m_availBytes == 0, "At this point, our internal buffer should be empty, but it's not: %zu", m_availBytes);
+    m_cursor = 0;
+    if (m_buffer && (m_bufferSize < m_blockSize))
+        releaseBuffer();
+    if (!m_buffer) {
+        m_bufferSize = m_blockSize;
+        m_buffer = IOBufferPool::acquire(m_bufferSize);
+    }
+    ssize_t r;
+    try {
+        r = getIO()->read(m_buffer, m_blockSize);
+    }
+    catch (EAgain &) {
+        // nothing came in yet; the buffer doesn't need to stay with us while we wait.
+        releaseBuffer();
+        throw;
+    }
+    EAssert(r >= 0, "BStream got an error while reading: %zi", r);
+    m_availBytes = r;
+    if (r == 0)
+        releaseBuffer();
+    else if (m_adaptive)
+        adapt(r);
+    return r;
+}
+
+void Balau::BStream::releaseBuffer() {
+    IOBufferPool::release(m_buffer, m_bufferSize);
+    m_buffer = NULL;
+}
+
 ssize_t Balau::BStream::read(void * _buf, size_t count) throw (Balau::GeneralException) {
     if (m_passThru)
         return getIO()->read(_buf, count);
@@ -35,19 +96,17 @@ ssize_t Balau::BStream::read(void * _buf, size_t count) throw (Balau::GeneralExc
         copied = toCopy;
         buf += toCopy;
         toCopy = count;
+        if (m_availBytes == 0)
+            releaseBuffer();
     }
 
     if (count == 0)
         return copied;
 
-    if (count >= s_blockSize)
+    if (count >= m_blockSize)
         return getIO()->read(buf, count) + copied;
 
-    m_cursor = 0;
-    IAssert(m_availBytes == 0, "At this point, our internal buffer should be empty, but it's not: %zu", m_availBytes);
-    ssize_t r = getIO()->read(m_buffer, s_blockSize);
-    EAssert(r >= 0, "BStream got an error while reading: %zi", r);
-    m_availBytes = r;
+    fill();
 
     if (toCopy > m_availBytes)
         toCopy = m_availBytes;
@@ -57,23 +116,40 @@ ssize_t Balau::BStream::read(void * _buf, size_t count) throw (Balau::GeneralExc
     m_cursor += toCopy;
     m_availBytes -= toCopy;
     copied += toCopy;
+    if (m_availBytes == 0)
+        releaseBuffer();
 
     return copied;
 }
 
+ssize_t Balau::BStream::readv(const struct iovec * iov, int iovcnt) throw (Balau::GeneralException) {
+    if (m_passThru || ((m_availBytes == 0) && (iovSize(iov, iovcnt) >= m_blockSize)))
+        return getIO()->readv(iov, iovcnt);
+
+    // only the first read() may go to the underlying handle; the next buffers only get what's left in ours.
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t count = iov[i].iov_len;
+        if (count == 0)
+            continue;
+        if (total != 0) {
+            if (m_availBytes == 0)
+                break;
+            if (count > m_availBytes)
+                count = m_availBytes;
+        }
+        ssize_t r = read(iov[i].iov_base, count);
+        total += r;
+        if ((size_t) r < iov[i].iov_len)
+            break;
+    }
+    return total;
+}
+
 int Balau::BStream::peekNextByte() {
     m_passThru = false;
-    if (m_availBytes == 0) {
-        uint8_t b;
-        ssize_t r = read(&b, 1);
-        if (!r)
-            return -1;
-        EAssert(r == 1, "We asked for one byte, yet we got %zi", r);
-        IAssert(m_cursor > 0, "m_cursor is %zi", m_cursor);
-        IAssert(m_availBytes < s_blockSize, "m_availBytes = %zi; s_blockSize = %i", m_availBytes, s_blockSize);
-        m_cursor--;
-        m_availBytes++;
-    }
+    if ((m_availBytes == 0) && (fill() == 0))
+        return -1;
 
     return m_buffer[m_cursor];
 }
@@ -82,11 +158,13 @@ Balau::String Balau::BStream::readString(bool putNL) {
     if (getIO().isA<BStream>())
         return getIO().asA<BStream>()->readString(putNL);
 
-    peekNextByte();
     uint8_t * cr, * lf, * nl;
     String ret;
     size_t chunkSize = 0;
 
+    if (peekNextByte() < 0)
+        return ret;
+
     cr = (uint8_t *) memchr(m_buffer + m_cursor, '\r', m_availBytes);
     lf = (uint8_t *) memchr(m_buffer + m_cursor, '\n', m_availBytes);
     if (cr && lf) {
@@ -103,9 +181,11 @@ Balau::String Balau::BStream::readString(bool putNL) {
         ret += String((const char *) m_buffer + m_cursor, chunkSize);
         m_availBytes -= chunkSize;
         m_cursor += chunkSize;
+        releaseBuffer();
         if (isClosed() || isEOF())
             return ret;
-        peekNextByte();
+        if (peekNextByte() < 0)
+            return ret;
         IAssert(m_cursor == 0, "m_cursor is %zi", m_cursor);
         cr = (uint8_t *) memchr(m_buffer, '\r', m_availBytes);
         lf = (uint8_t *) memchr(m_buffer, '\n', m_availBytes);
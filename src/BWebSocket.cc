@@ -11,22 +11,23 @@ Balau::WebSocketFrame::WebSocketFrame(const uint8_t * data, size_t len, uint8_t
     if (m_len >= 126)   m_headerSize += 2;
     if (m_len >= 65536) m_headerSize += 6;
     if (doMask)         m_headerSize += 4;
-    m_data = (uint8_t *)malloc(m_len + m_headerSize);
+    m_dataSize = m_len;
+    m_data = IOBufferPool::acquire(m_dataSize);
     uint8_t * maskPtr;
 
-    m_data[0] = 0x80 | opcode;
-    m_data[1] = doMask ? 0x80 : 0x00;
+    m_header[0] = 0x80 | opcode;
+    m_header[1] = doMask ? 0x80 : 0x00;
     if (m_len < 125) {
-        m_data[1] |= m_len;
-        maskPtr = m_data + 2;
+        m_header[1] |= m_len;
+        maskPtr = m_header + 2;
     } else if (m_len < 65536) {
-        m_data[1] |= 126;
-        m_data[2] = (m_len >> 8) & 0xff;
-        m_data[3] = m_len & 0xff;
-        maskPtr = m_data + 4;
+        m_header[1] |= 126;
+        m_header[2] = (m_len >> 8) & 0xff;
+        m_header[3] = m_len & 0xff;
+        maskPtr = m_header + 4;
     } else {
-        m_data[1] |= 127;
-        uint8_t * lenPtr = maskPtr = m_data + 10;
+        m_header[1] |= 127;
+        uint8_t * lenPtr = maskPtr = m_header + 10;
         size_t len = m_len;
         *(--lenPtr) = len & 0xff; len >>= 8;
         *(--lenPtr) = len & 0xff; len >>= 8;
@@ -48,28 +49,39 @@ Balau::WebSocketFrame::WebSocketFrame(const uint8_t * data, size_t len, uint8_t
         m_mask = 0;
     }
 
-    if (data) memcpy(maskPtr, data, m_len);
+    if (data) memcpy(m_data, data, m_len);
 }
 
 uint8_t & Balau::WebSocketFrame::operator[](size_t idx) {
     static uint8_t dummy = 0;
     if (idx >= m_len) return dummy;
-    return m_data[idx + m_headerSize];
+    return m_data[idx];
 }
 
 void Balau::WebSocketFrame::send(Balau::IO<Balau::Handle> socket) {
     size_t totalLen = m_headerSize + m_len;
 
     if (m_mask) {
-        for (size_t i = m_headerSize; i < totalLen; i++) {
+        for (size_t i = 0; i < m_len; i++) {
             m_data[i] ^= m_mask >> 24;
             m_mask = rotate(m_mask);
         }
         m_mask = 0;
     }
 
+    // header and payload go out together, in a single writev.
     while (m_bytesSent < totalLen) {
-        ssize_t r = socket->write(m_data + m_bytesSent, totalLen - m_bytesSent);
+        int n = 0;
+        if (m_bytesSent < m_headerSize) {
+            m_iov[n].iov_base = m_header + m_bytesSent;
+            m_iov[n++].iov_len = m_headerSize - m_bytesSent;
+        }
+        size_t payloadSent = m_bytesSent > m_headerSize ? m_bytesSent - m_headerSize : 0;
+        if (payloadSent < m_len) {
+            m_iov[n].iov_base = m_data + payloadSent;
+            m_iov[n++].iov_len = m_len - payloadSent;
+        }
+        ssize_t r = socket->writev(m_iov, n);
         if (r < 0)
             m_bytesSent = totalLen;
         else
@@ -78,8 +90,8 @@ void Balau::WebSocketFrame::send(Balau::IO<Balau::Handle> socket) {
 }
 
 Balau::WebSocketWorker::~WebSocketWorker() {
-    free(m_payload);
-    free(m_payloadCTRL);
+    IOBufferPool::release(m_payload, m_payloadSize);
+    IOBufferPool::release(m_payloadCTRL, m_payloadSizeCTRL);
     delete m_sending;
     while (!m_sendQueue.isEmpty())
         delete m_sendQueue.pop();
@@ -89,6 +101,7 @@ void Balau::WebSocketWorker::Do() {
     uint8_t c;
 
     uint8_t ** payloadP;
+    size_t * payloadSizeP;
     uint64_t * payloadLenP;
     uint64_t * totalLenP;
     uint64_t * remainingBytesP;
@@ -100,6 +113,7 @@ void Balau::WebSocketWorker::Do() {
     std::function<void()> switchPacketType = [&]() {
         if (m_inCTRL) {
             payloadP = &m_payloadCTRL;
+            payloadSizeP = &m_payloadSizeCTRL;
             payloadLenP = &m_payloadLenCTRL;
             totalLenP = &m_totalLenCTRL;
             remainingBytesP = &m_remainingBytesCTRL;
@@ -108,6 +122,7 @@ void Balau::WebSocketWorker::Do() {
             hasMaskP = &m_hasMaskCTRL;
         } else {
             payloadP = &m_payload;
+            payloadSizeP = &m_payloadSize;
             payloadLenP = &m_payloadLen;
             totalLenP = &m_totalLen;
             remainingBytesP = &m_remainingBytes;
@@ -215,7 +230,16 @@ void Balau::WebSocketWorker::Do() {
                 *remainingBytesP = *payloadLenP;
                 if (*totalLenP >= MAX_WEBSOCKET_LIMIT)
                     goto error;
-                *payloadP = (uint8_t *) realloc(*payloadP, *totalLenP + (*opcodeP == OPCODE_TEXT ? 1 : 0));
+                if (*totalLenP + 1 > *payloadSizeP) {
+                    // the earlier fragments of the message, if any, move over to the larger buffer.
+                    size_t size = *totalLenP + 1;
+                    uint8_t * payload = IOBufferPool::acquire(size);
+                    if (*payloadP)
+                        memcpy(payload, *payloadP, *totalLenP - *payloadLenP);
+                    IOBufferPool::release(*payloadP, *payloadSizeP);
+                    *payloadP = payload;
+                    *payloadSizeP = size;
+                }
             case READ_PL:
                 while (*remainingBytesP) {
                     ssize_t r = m_socket->read(*payloadP + *totalLenP - *remainingBytesP, *remainingBytesP);
@@ -242,6 +266,9 @@ void Balau::WebSocketWorker::Do() {
                     if (*opcodeP == OPCODE_TEXT)
                         payload[totalLen] = 0;
                     processMessage();
+                    IOBufferPool::release(*payloadP, *payloadSizeP);
+                    *payloadP = NULL;
+                    *payloadSizeP = 0;
                 }
 
                 m_state = READ_H;
@@ -34,6 +34,22 @@ ssize_t Balau::Buffer::read(void * buf, size_t count) throw (GeneralException) {
     return count;
 }
 
+ssize_t Balau::Buffer::transferTo(IO<Handle> dest, size_t count) throw (GeneralException) {
+    off64_t cursor = rtell();
+    if (cursor >= m_bufSize)
+        return 0;
+    size_t avail = m_bufSize - cursor;
+
+    if (count > avail)
+        count = avail;
+
+    ssize_t r = dest->write(m_buffer + cursor, count);
+    if (r > 0)
+        rseek(cursor + r);
+
+    return r;
+}
+
 ssize_t Balau::Buffer::write(const void * buf, size_t count) throw (GeneralException) {
     if (m_fromConst)
         throw GeneralException("Buffer is read only and can't be written to.");
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <memory>
 #include <typeinfo>
 #include <errno.h>
@@ -44,6 +45,49 @@ ssize_t Balau::Handle::write(const void * buf, size_t count) throw (GeneralExcep
     return -1;
 }
 
+ssize_t Balau::Handle::readv(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        ssize_t r = read(iov[i].iov_base, iov[i].iov_len);
+        if (r < 0)
+            return total ? total : r;
+        total += r;
+        // a read that could EAgain would lose what we already got; stop at the first buffer for these.
+        if (((size_t) r < iov[i].iov_len) || canEAgainOnRead())
+            break;
+    }
+    return total;
+}
+
+ssize_t Balau::Handle::writev(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        ssize_t r = write(iov[i].iov_base, iov[i].iov_len);
+        if (r < 0)
+            return total ? total : r;
+        total += r;
+        if (((size_t) r < iov[i].iov_len) || canEAgainOnWrite())
+            break;
+    }
+    return total;
+}
+
+ssize_t Balau::Handle::transferTo(IO<Handle> dest, size_t count) throw (GeneralException) {
+    uint8_t buf[16384];
+    ssize_t r = read(buf, std::min(count, sizeof(buf)));
+    if (r <= 0)
+        return r;
+    return dest->forceWrite(buf, r);
+}
+
+ssize_t Balau::Handle::receiveFile(int fd, off64_t offset, size_t count) throw (GeneralException) {
+    throw GeneralException(String("Handle ") + getName() + " can't receive files directly (missing in class " + ClassName(this).c_str() + ")");
+}
+
 ssize_t Balau::Handle::forceRead(void * _buf, size_t count, Events::BaseEvent * evt) throw (GeneralException) {
     ssize_t total = 0;
     uint8_t * buf = (uint8_t *) _buf;
@@ -98,6 +142,52 @@ ssize_t Balau::Handle::forceWrite(const void * _buf, size_t count, Events::BaseE
     return total;
 }
 
+ssize_t Balau::Handle::forceWritev(const struct iovec * iov, int iovcnt, Events::BaseEvent * evt) throw (GeneralException) {
+    ssize_t total = 0;
+    if (!canWrite())
+        throw GeneralException("Handle can't write");
+
+    // what's left to write, a window of the caller's array at a time, with its first entry trimmed as we go.
+    static const int WINDOW = 16;
+    struct iovec left[WINDOW];
+    int n = 0, first = 0, next = 0;
+
+    while (!isClosed()) {
+        if (first == n) {
+            first = n = 0;
+            for (; (next < iovcnt) && (n < WINDOW); next++)
+                if (iov[next].iov_len)
+                    left[n++] = iov[next];
+            if (n == 0)
+                break;
+        }
+        ssize_t r;
+        try {
+            r = writev(left + first, n - first);
+        }
+        catch (EAgain & e) {
+            if (evt && evt->gotSignal())
+                return total;
+            Task::operationYield(e.getEvent());
+            continue;
+        }
+        if (r < 0)
+            return r;
+        total += r;
+        while ((r > 0) && (first < n)) {
+            if ((size_t) r >= left[first].iov_len) {
+                r -= left[first++].iov_len;
+            } else {
+                left[first].iov_base = (uint8_t *) left[first].iov_base + r;
+                left[first].iov_len -= r;
+                r = 0;
+            }
+        }
+    }
+
+    return total;
+}
+
 template<class T>
 Balau::Future<T> genericRead(Balau::IO<Balau::Handle> t) {
     std::shared_ptr<T> b(new T);
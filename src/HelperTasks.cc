@@ -1,6 +1,7 @@
 #include <algorithm>
 
 #include "HelperTasks.h"
+#include "IOBufferPool.h"
 
 Balau::CopyTask::CopyTask(IO<Handle> s, IO<Handle> d, ssize_t tocopy)
     : m_s(s)
@@ -8,6 +9,8 @@ Balau::CopyTask::CopyTask(IO<Handle> s, IO<Handle> d, ssize_t tocopy)
     , m_tocopy(tocopy)
 {
     m_name.set("CopyTask from %s to %s", s->getName(), d->getName());
+    // bulk copies shouldn't get in the way of latency sensitive tasks
+    setPriority(PRIORITY_LOW);
 }
 
 void Balau::CopyTask::Do() {
@@ -19,10 +22,16 @@ void Balau::CopyTask::Do() {
             case 0:
                 toread = m_tocopy >= 0 ? m_tocopy - m_current : COPY_BUFSIZE;
                 toread = std::min(toread, (ssize_t) COPY_BUFSIZE);
+                if (!m_buffer) {
+                    m_bufferSize = COPY_BUFSIZE;
+                    m_buffer = IOBufferPool::acquire(m_bufferSize);
+                }
                 m_read = m_s->read(m_buffer, toread);
                 AAssert(m_read >= 0, "Error while reading");
-                if (!m_read)
+                if (!m_read) {
+                    releaseBuffer();
                     return;
+                }
                 m_written = 0;
                 m_state = 1;
             case 1:
@@ -33,12 +42,21 @@ void Balau::CopyTask::Do() {
                 } while (m_read != m_written);
                 m_state = 0;
                 m_current += m_read;
-                if (m_s->isEOF())
+                if (m_s->isEOF()) {
+                    releaseBuffer();
                     return;
+                }
             }
         }
     }
     catch (EAgain &) {
+        if (m_state == 0)
+            releaseBuffer();
         taskSwitch();
     }
 }
+
+void Balau::CopyTask::releaseBuffer() {
+    IOBufferPool::release(m_buffer, m_bufferSize);
+    m_buffer = NULL;
+}
@@ -34,9 +34,15 @@ bool Balau::HttpActionStatic::Do(HttpServer * server, Http::Request & req, HttpS
         response.SetResponseCode(404);
         response.SetContentType("text/plain");
     }
+    else if (m_streaming && (file->getSize() >= 0)) {
+        response.SetContentType(Http::getContentType(extension));
+        response.Stream(file, file->getSize());
+        file->close();
+        return true;
+    }
     else {
         Events::TaskEvent evt;
-        Task * copy = TaskMan::registerTask(new CopyTask(file, response.get()), &evt);
+        Task * copy = TaskMan::registerTask(new CopyTask(file, response.getSegmented()), &evt);
         Task::operationYield(&evt);
         file->close();
         response.SetContentType(Http::getContentType(extension));
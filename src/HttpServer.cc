@@ -20,6 +20,19 @@ class OutputCheck : public Balau::Filter {
         m_wrote = true;
         return Filter::write(buf, count);
     }
+    virtual ssize_t writev(const struct iovec * iov, int iovcnt) throw (Balau::GeneralException) {
+        if (!iovSize(iov, iovcnt))
+            return 0;
+        m_wrote = true;
+        return getIO()->writev(iov, iovcnt);
+    }
+    virtual bool canReceiveFile() { return getIO()->canReceiveFile(); }
+    virtual ssize_t receiveFile(int fd, off64_t offset, size_t count) throw (Balau::GeneralException) {
+        if (!count)
+            return 0;
+        m_wrote = true;
+        return Filter::receiveFile(fd, offset, count);
+    }
     virtual const char * getName() { return m_name.to_charp(); }
     bool wrote() { return m_wrote; }
   private:
@@ -238,7 +251,8 @@ void Balau::HttpWorker::sendError(int error, const char * msg, const char * deta
 }
 
 bool Balau::HttpWorker::handleClient() {
-    Events::Timeout evtTimeout(s_httpTimeout);
+    // almost never fires, and there's one per request; no need for a precise libev timer.
+    Events::CoarseTimeout evtTimeout(s_httpTimeout);
     waitFor(&evtTimeout);
     setOkayToEAgain(true);
 
@@ -702,6 +716,63 @@ void Balau::HttpServer::Response::Flush() {
     AAssert(!m_flushed, "HttpResponse already flushed.");
 
     m_flushed = true;
+
+    if (!m_segmented) {
+        IO<Buffer> headers = buildHeaders(m_noSize ? -1 : m_buffer->getSize());
+        struct iovec iov[2] = {
+            { (void *) headers->getBuffer(), (size_t) headers->getSize() },
+            { (void *) m_buffer->getBuffer(), (size_t) m_buffer->getSize() },
+        };
+        m_out->forceWritev(iov, 2);
+        return;
+    }
+
+    IO<Buffer> headers = buildHeaders(m_noSize ? -1 : m_segments->getSize());
+    // the headers and the body's segments go out together, a window of them at a time.
+    struct iovec iov[16];
+    iov[0].iov_base = (void *) headers->getBuffer();
+    iov[0].iov_len = headers->getSize();
+    int n = 1;
+    off64_t offset = 0;
+    for (;;) {
+        int segments = m_segments->getSegments(iov + n, 16 - n, offset);
+        offset += Handle::iovSize(iov + n, segments);
+        m_out->forceWritev(iov, n + segments);
+        n = 0;
+        if ((offset >= m_segments->getSize()) || m_out->isClosed())
+            break;
+    }
+}
+
+Balau::IO<Balau::SegmentedBuffer> Balau::HttpServer::Response::getSegmented() {
+    if (!m_segmented) {
+        AAssert(m_buffer->getSize() == 0, "Can't switch to segments once the body got written to with get().");
+        m_segments = new SegmentedBuffer();
+        m_segmented = true;
+    }
+    return m_segments;
+}
+
+void Balau::HttpServer::Response::Stream(IO<Handle> body, off64_t length) {
+    AAssert(!m_flushed, "HttpResponse already flushed.");
+    AAssert((m_buffer->getSize() == 0) && (!m_segmented || (m_segments->getSize() == 0)), "Can't stream a response that already got a body written.");
+
+    m_flushed = true;
+    IO<Buffer> headers = buildHeaders(length);
+    m_out->forceWrite(headers->getBuffer(), headers->getSize());
+
+    while ((length > 0) && !m_out->isClosed()) {
+        ssize_t r = body->transferTo(m_out, length);
+        if (r <= 0)
+            break;
+        length -= r;
+    }
+    // the body came out shorter than announced; the client can only tell if we hang up.
+    if ((length > 0) && !m_out->isClosed())
+        m_out->close();
+}
+
+Balau::IO<Balau::Buffer> Balau::HttpServer::Response::buildHeaders(off64_t contentLength) {
     IO<Buffer> headers(new Buffer());
 
     headers->writeString("HTTP/");
@@ -715,9 +786,9 @@ void Balau::HttpServer::Response::Flush() {
         headers->writeString("\r\nContent-Type: ");
         headers->writeString(m_type);
     }
-    if (!m_noSize) {
+    if (contentLength >= 0) {
         headers->writeString("\r\nContent-Length: ");
-        String len(m_buffer->getSize());
+        String len(contentLength);
         headers->writeString(len);
     }
     headers->writeString("\r\nServer: ");
@@ -735,6 +806,5 @@ void Balau::HttpServer::Response::Flush() {
 
     headers->writeString("\r\n");
 
-    m_out->forceWrite(headers->getBuffer(), headers->getSize());
-    m_out->forceWrite(m_buffer->getBuffer(), m_buffer->getSize());
+    return headers;
 }
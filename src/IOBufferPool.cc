@@ -0,0 +1,105 @@
+#include <stdlib.h>
+#include <new>
+#include "IOBufferPool.h"
+#include "Local.h"
+
+std::atomic<uint64_t> Balau::IOBufferPool::s_hits(0);
+std::atomic<uint64_t> Balau::IOBufferPool::s_misses(0);
+std::atomic<int64_t> Balau::IOBufferPool::s_inUse(0);
+std::atomic<int64_t> Balau::IOBufferPool::s_cached(0);
+
+namespace Balau {
+
+struct IOBufferPoolTLS {
+    struct Block {
+        Block * m_next;
+    };
+      ~IOBufferPoolTLS() {
+        for (int i = 0; i < IOBufferPool::NUM_SIZES; i++) {
+            while (m_heads[i]) {
+                Block * b = m_heads[i];
+                m_heads[i] = b->m_next;
+                IOBufferPool::s_cached -= IOBufferPool::MIN_SIZE << i;
+                free(b);
+            }
+        }
+    }
+    Block * m_heads[IOBufferPool::NUM_SIZES] = { NULL };
+    unsigned m_counts[IOBufferPool::NUM_SIZES] = { 0 };
+};
+
+};
+
+static Balau::IOBufferPoolTLS * getPool() {
+    // never destroyed: buffers may still get released while the process exits.
+    static Balau::PThreadsTLSFactory<Balau::IOBufferPoolTLS> * tls = new Balau::PThreadsTLSFactory<Balau::IOBufferPoolTLS>();
+    return tls->get();
+}
+
+int Balau::IOBufferPool::sizeIndex(size_t size) {
+    int i = 0;
+    while ((MIN_SIZE << i) < size)
+        i++;
+    return i;
+}
+
+uint8_t * Balau::IOBufferPool::acquire(size_t & size) {
+    if (size > MAX_SIZE) {
+        s_misses++;
+        s_inUse += size;
+        uint8_t * r = (uint8_t *) malloc(size);
+        if (!r)
+            throw std::bad_alloc();
+        return r;
+    }
+
+    int i = sizeIndex(size);
+    size = MIN_SIZE << i;
+    s_inUse += size;
+    IOBufferPoolTLS * pool = getPool();
+    IOBufferPoolTLS::Block * b = pool->m_heads[i];
+    if (b) {
+        pool->m_heads[i] = b->m_next;
+        pool->m_counts[i]--;
+        s_hits++;
+        s_cached -= size;
+        return (uint8_t *) b;
+    }
+
+    s_misses++;
+    uint8_t * r = (uint8_t *) malloc(size);
+    if (!r)
+        throw std::bad_alloc();
+    return r;
+}
+
+void Balau::IOBufferPool::release(uint8_t * buffer, size_t size) {
+    if (!buffer)
+        return;
+    s_inUse -= size;
+    if (size > MAX_SIZE) {
+        free(buffer);
+        return;
+    }
+
+    int i = sizeIndex(size);
+    IOBufferPoolTLS * pool = getPool();
+    if ((pool->m_counts[i] + 1) * size > MAX_CACHED) {
+        free(buffer);
+        return;
+    }
+    IOBufferPoolTLS::Block * b = (IOBufferPoolTLS::Block *) buffer;
+    b->m_next = pool->m_heads[i];
+    pool->m_heads[i] = b;
+    pool->m_counts[i]++;
+    s_cached += size;
+}
+
+Balau::IOBufferPool::Stats Balau::IOBufferPool::getStats() {
+    Stats r;
+    r.hits = s_hits.load();
+    r.misses = s_misses.load();
+    r.inUse = s_inUse.load();
+    r.cached = s_cached.load();
+    return r;
+}
@@ -3,28 +3,44 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <algorithm>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
 #include <io.h>
 #endif
 #include "Async.h"
+#include "FreeList.h"
 #include "Input.h"
+#include "IoUring.h"
 #include "Task.h"
 #include "TaskMan.h"
 #include "Printer.h"
 
 namespace {
 
-struct cbResults_t {
-    Balau::Events::Custom evt;
-    ssize_t result;
-    int errorno;
+struct cbResults_t : public Balau::IoResults, public Balau::Pooled<cbResults_t> {
     struct stat statdata;
-    enum { NONE, OPEN, STAT, CLOSE, READ } type;
+#ifdef HAVE_IO_URING
+    struct statx statxdata;
+    bool viaRing = false;
+#endif
+    enum { NONE, OPEN, STAT, CLOSE, READ, ADVISE } type;
+    // the operation running on the async threads, until its done()
+    Balau::AsyncOperation * op = NULL;
 };
 
-class AsyncOpOpen : public Balau::AsyncOperation {
+void completed(cbResults_t * results, bool skipped) {
+    results->op = NULL;
+    if (skipped) {
+        results->result = -1;
+        results->errorno = ECANCELED;
+    }
+    results->evt.doSignal();
+}
+
+class AsyncOpOpen : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpOpen> {
   public:
       AsyncOpOpen(const char * path, cbResults_t * results) : m_path(path), m_results(results) { }
     virtual void run() {
@@ -36,7 +52,7 @@ class AsyncOpOpen : public Balau::AsyncOperation {
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -44,15 +60,16 @@ class AsyncOpOpen : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
-class AsyncOpStat : public Balau::AsyncOperation {
+class AsyncOpStat : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpStat> {
   public:
       AsyncOpStat(int fd, cbResults_t * results) : m_fd(fd), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
         const ssize_t r = m_results->result = fstat(m_fd, &m_results->statdata);
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -60,6 +77,44 @@ class AsyncOpStat : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
+#ifdef HAVE_IO_URING
+// the ring of the TaskMan we're running on, if it could set one up.
+Balau::IoUring * ioUring() {
+    Balau::Task * t = Balau::Task::getCurrentTask();
+    return t ? t->getTaskMan()->getIoUring() : NULL;
+}
+#endif
+
+void queueOpen(const char * path, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepOpen(results, path, O_RDONLY, 0))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpOpen(path, results));
+}
+
+void queueStat(int fd, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepStat(results, fd, &results->statxdata)) {
+        results->viaRing = true;
+        return;
+    }
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpStat(fd, results));
+}
+
+// the ring gives us a statx; fill the few fields we use in statdata.
+void gotStat(cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    if (results->viaRing) {
+        results->statdata.st_size = results->statxdata.stx_size;
+        results->statdata.st_mtime = results->statxdata.stx_mtime.tv_sec;
+    }
+#endif
+}
+
 };
 
 Balau::Input::Input(const char * fname) {
@@ -90,7 +145,7 @@ void Balau::Input::open() throw (GeneralException) {
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::OPEN;
-            createAsyncOp(new AsyncOpOpen(m_fname.to_charp(), cbResults));
+            queueOpen(m_fname.to_charp(), cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::OPEN:
             AAssert(isPendingComplete(), "Don't call open again without checking isPendingComplete.");
@@ -108,9 +163,10 @@ void Balau::Input::open() throw (GeneralException) {
             delete cbResults;
             m_pendingOp = cbResults = new cbResults_t();
             cbResults->type = cbResults_t::STAT;
-            createAsyncOp(new AsyncOpStat(m_fd, cbResults));
+            queueStat(m_fd, cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::STAT:
+            gotStat(cbResults);
             AAssert(isPendingComplete(), "Don't call open again without checking isPendingComplete.");
             if (cbResults->result == 0) {
                 m_size = cbResults->statdata.st_size;
@@ -138,15 +194,16 @@ void Balau::Input::open() throw (GeneralException) {
 
 namespace {
 
-class AsyncOpClose : public Balau::AsyncOperation {
+class AsyncOpClose : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpClose> {
   public:
       AsyncOpClose(int fd, cbResults_t * results) : m_fd(fd), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
         const ssize_t r = m_results->result = close(m_fd);
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -154,6 +211,15 @@ class AsyncOpClose : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
+void queueClose(int fd, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepClose(results, fd))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpClose(fd, results));
+}
+
 };
 
 void Balau::Input::close() throw (GeneralException) {
@@ -169,14 +235,33 @@ void Balau::Input::close() throw (GeneralException) {
         cbResults = (cbResults_t *) m_pendingOp;
     }
 
+    // don't close the fd from under an operation still in flight; cancel it, which skips it entirely if no worker
+    // got to it yet, and wait for it to be over.
+    if ((cbResults->type != cbResults_t::NONE) && (cbResults->type != cbResults_t::CLOSE)) {
+        if (!cbResults->evt.gotSignal()) {
+            if (cbResults->op)
+                cbResults->op->cancel();
+            Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
+        }
+        if ((cbResults->type == cbResults_t::OPEN) && (cbResults->result >= 0))
+            m_fd = (int) cbResults->result;
+        delete cbResults;
+        m_pendingOp = NULL;
+        if (m_fd < 0)
+            return;
+        m_pendingOp = cbResults = new cbResults_t;
+        cbResults->type = cbResults_t::NONE;
+    }
+
     try {
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::CLOSE;
-            createAsyncOp(new AsyncOpClose(m_fd, cbResults));
+            queueClose(m_fd, cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::CLOSE:
             m_fd = -1;
+            m_aheadFrom = m_aheadTo = 0;
             if (cbResults->result < 0) {
                 char buf[4096];
                 const char * str = strerror_ts(cbResults->errorno, buf, sizeof(buf));
@@ -204,10 +289,18 @@ void Balau::Input::close() throw (GeneralException) {
 
 namespace {
 
-class AsyncOpRead : public Balau::AsyncOperation {
+class AsyncOpRead : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpRead> {
   public:
-      AsyncOpRead(int fd, void * buf, size_t count, off64_t offset, cbResults_t * results) : m_fd(fd), m_buf(buf), m_count(count), m_offset(offset), m_results(results) { }
+      AsyncOpRead(int fd, const struct iovec * iov, int iovcnt, off64_t offset, cbResults_t * results) : m_fd(fd), m_iov(iov), m_iovcnt(iovcnt), m_offset(offset), m_results(results) {
+          // a lone buffer is copied, so read() can give us its iovec off the stack.
+          if (iovcnt == 1) {
+              m_single = iov[0];
+              m_iov = &m_single;
+          }
+      }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
+#if defined(_MSC_VER) || defined(__APPLE__)
 #ifdef _MSC_VER
         off64_t offset = _lseeki64(m_fd, m_offset, SEEK_SET);
         if (offset < 0) {
@@ -215,27 +308,61 @@ class AsyncOpRead : public Balau::AsyncOperation {
             m_results->errorno = errno;
             return;
         }
-        const ssize_t r = m_results->result = read(m_fd, m_buf, m_count);
+#endif
+        ssize_t total = 0, r = 0;
+        for (int i = 0; i < m_iovcnt; i++) {
+#ifdef _MSC_VER
+            r = read(m_fd, m_iov[i].iov_base, m_iov[i].iov_len);
 #else
-        const ssize_t r = m_results->result = pread(m_fd, m_buf, m_count, m_offset);
+            r = pread(m_fd, m_iov[i].iov_base, m_iov[i].iov_len, m_offset + total);
 #endif
+            if (r < 0)
+                break;
+            total += r;
+            if ((size_t) r < m_iov[i].iov_len)
+                break;
+        }
+        m_results->result = ((r < 0) && (total == 0)) ? -1 : total;
+        m_results->errorno = ((r < 0) && (total == 0)) ? errno : 0;
+#else
+        const ssize_t r = m_results->result = m_iovcnt == 1 ? pread(m_fd, m_single.iov_base, m_single.iov_len, m_offset) : preadv(m_fd, m_iov, m_iovcnt, m_offset);
         m_results->errorno = r < 0 ? errno : 0;
+#endif
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
     int m_fd;
-    void * m_buf;
-    size_t m_count;
+    const struct iovec * m_iov;
+    struct iovec m_single;
+    int m_iovcnt;
     off64_t m_offset;
     cbResults_t * m_results;
 };
 
+void queueRead(int fd, const struct iovec * iov, int iovcnt, off64_t offset, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ((iovcnt == 1) ? ring->prepRead(results, fd, iov[0].iov_base, iov[0].iov_len, offset) : ring->prepReadv(results, fd, iov, iovcnt, offset)))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpRead(fd, iov, iovcnt, offset, results));
+}
+
 };
 
 ssize_t Balau::Input::read(void * buf, size_t count) throw (GeneralException) {
+    struct iovec iov = { buf, count };
+    return readInternal(&iov, 1);
+}
+
+ssize_t Balau::Input::readv(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    return readInternal(iov, std::min(iovcnt, IOV_MAX));
+}
+
+ssize_t Balau::Input::readInternal(const struct iovec * iov, int iovcnt) throw (GeneralException) {
     AAssert(!isClosed(), "Can't read a closed file");
     ssize_t result;
 
@@ -252,7 +379,7 @@ ssize_t Balau::Input::read(void * buf, size_t count) throw (GeneralException) {
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::READ;
-            createAsyncOp(new AsyncOpRead(m_fd, buf, count, getROffset(), cbResults));
+            queueRead(m_fd, iov, iovcnt, getROffset(), cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::READ:
             result = cbResults->result;
@@ -286,6 +413,145 @@ ssize_t Balau::Input::read(void * buf, size_t count) throw (GeneralException) {
     return -1;
 }
 
+namespace {
+
+class AsyncOpAdvise : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpAdvise> {
+  public:
+      AsyncOpAdvise(int fd, off64_t offset, off64_t len, int advice, cbResults_t * results) : m_fd(fd), m_offset(offset), m_len(len), m_advice(advice), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
+    virtual void run() {
+        int r = 0, err = 0;
+#if defined(__linux__)
+        // readahead() actually starts the reads, where WILLNEED may only be taken as a hint.
+        if (m_advice == Balau::Input::ADVICE_READAHEAD) {
+            r = readahead(m_fd, m_offset, m_len);
+            err = r < 0 ? errno : 0;
+        } else {
+            err = posix_fadvise(m_fd, m_offset, m_len, fadviseFlag());
+            r = err ? -1 : 0;
+        }
+#elif !defined(_MSC_VER) && !defined(__APPLE__)
+        err = posix_fadvise(m_fd, m_offset, m_len, fadviseFlag());
+        r = err ? -1 : 0;
+#endif
+        if (!m_results) {
+            if (r < 0)
+                Balau::Printer::elog(Balau::E_INPUT, "Advice %i on fd %i failed with errno %i", m_advice, m_fd, err);
+            return;
+        }
+        m_results->result = r;
+        m_results->errorno = err;
+    }
+    virtual void done() {
+        if (m_results)
+            completed(m_results, wasSkipped());
+        delete this;
+    }
+    // without results to fill, nobody waits on us.
+    virtual bool needsSynchronousCallback() { return m_results != NULL; }
+  private:
+#if !defined(_MSC_VER) && !defined(__APPLE__)
+    int fadviseFlag() {
+        switch (m_advice) {
+        case Balau::Input::ADVICE_SEQUENTIAL: return POSIX_FADV_SEQUENTIAL;
+        case Balau::Input::ADVICE_RANDOM: return POSIX_FADV_RANDOM;
+        case Balau::Input::ADVICE_READAHEAD:
+        case Balau::Input::ADVICE_WILLNEED: return POSIX_FADV_WILLNEED;
+        case Balau::Input::ADVICE_DONTNEED: return POSIX_FADV_DONTNEED;
+        case Balau::Input::ADVICE_NOREUSE: return POSIX_FADV_NOREUSE;
+        default: return POSIX_FADV_NORMAL;
+        }
+    }
+#endif
+    int m_fd;
+    off64_t m_offset, m_len;
+    int m_advice;
+    cbResults_t * m_results;
+};
+
+};
+
+ssize_t Balau::Input::transferTo(IO<Handle> dest, size_t count) throw (GeneralException) {
+    AAssert(!isClosed(), "Can't transfer from a closed file");
+    if (!dest->canReceiveFile())
+        return Handle::transferTo(dest, count);
+
+    if ((m_size >= 0) && (count > (size_t) (m_size - getROffset())))
+        count = m_size - getROffset();
+    if (count > TRANSFER_CHUNK)
+        count = TRANSFER_CHUNK;
+    if (count == 0)
+        return 0;
+    off64_t offset = getROffset();
+    // the copy itself runs on our thread; unless it's already been asked for, pull the chunk in the page cache from
+    // the async threads first, so it doesn't stall the TaskMan on the disk.
+    if ((offset < m_aheadFrom) || ((off64_t) (offset + count) > m_aheadTo)) {
+        readahead(offset, count);
+        m_aheadFrom = offset;
+        m_aheadTo = offset + count;
+    }
+    // and the next one is on its way while this one is sent, without waiting on it.
+    off64_t next = offset + count + TRANSFER_CHUNK;
+    if ((m_size >= 0) && (next > m_size))
+        next = m_size;
+    if (next > m_aheadTo) {
+        createAsyncOp(new AsyncOpAdvise(m_fd, m_aheadTo, next - m_aheadTo, ADVICE_READAHEAD, NULL));
+        m_aheadTo = next;
+    }
+    ssize_t r = dest->receiveFile(m_fd, offset, count);
+    if (r > 0)
+        rseek(r, SEEK_CUR);
+    return r;
+}
+
+void Balau::Input::readahead(off64_t offset, off64_t len) throw (GeneralException) {
+    if ((len == 0) && (m_size > offset))
+        len = m_size - offset;
+    fadvise(offset, len, ADVICE_READAHEAD);
+}
+
+void Balau::Input::fadvise(off64_t offset, off64_t len, Advice advice) throw (GeneralException) {
+    AAssert(!isClosed(), "Can't advise on a closed file");
+
+    cbResults_t * cbResults;
+
+    if (!m_pendingOp) {
+        m_pendingOp = cbResults = new cbResults_t;
+        cbResults->type = cbResults_t::NONE;
+    } else {
+        cbResults = (cbResults_t *) m_pendingOp;
+    }
+
+    try {
+        switch (cbResults->type) {
+        case cbResults_t::NONE:
+            cbResults->type = cbResults_t::ADVISE;
+            cbResults->op = createAsyncOp(new AsyncOpAdvise(m_fd, offset, len, advice, cbResults));
+            Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
+        case cbResults_t::ADVISE:
+            // these are only hints; the reads will still work if the kernel didn't take them.
+            if (cbResults->result < 0)
+                Printer::elog(E_INPUT, "Advice %i on file %s failed with errno %i", advice, m_fname.to_charp(), cbResults->errorno);
+            delete cbResults;
+            m_pendingOp = NULL;
+            break;
+        default:
+            AAssert(false, "Don't switch operations while one is still not complete.");
+        }
+    }
+    catch (Balau::TaskSwitch) {
+        throw;
+    }
+    catch (Balau::EAgain) {
+        throw;
+    }
+    catch (...) {
+        delete cbResults;
+        m_pendingOp = NULL;
+        throw;
+    }
+}
+
 bool Balau::Input::isClosed() {
     return m_fd < 0;
 }
@@ -0,0 +1,274 @@
+#include "IoUring.h"
+
+#ifdef HAVE_IO_URING
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "Printer.h"
+
+namespace {
+
+int io_uring_setup(unsigned entries, struct io_uring_params * p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+int io_uring_register(int fd, unsigned opcode, void * arg, unsigned nrArgs) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+template<class T>
+T * ringPtr(void * ring, uint32_t offset) { return reinterpret_cast<T *>(static_cast<char *>(ring) + offset); }
+
+};
+
+Balau::IoUring * Balau::IoUring::create(struct ev_loop * loop) {
+    IoUring * r = new IoUring(loop);
+    if (r->setup())
+        return r;
+    delete r;
+    return NULL;
+}
+
+bool Balau::IoUring::setup() {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    m_fd = io_uring_setup(ENTRIES, &p);
+    if (m_fd < 0) {
+        Printer::elog(E_TASK, "io_uring_setup failed with errno %i; file operations will go through the async threads", errno);
+        return false;
+    }
+
+    // statx, openat and friends only got there in 5.6, and are the ones we need.
+    static const int opcodes[] = { IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READV, IORING_OP_WRITEV, IORING_OP_CLOSE };
+    const size_t probeSize = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe * probe = (struct io_uring_probe *) calloc(1, probeSize);
+    bool supported = io_uring_register(m_fd, IORING_REGISTER_PROBE, probe, 256) >= 0;
+    for (int op : opcodes)
+        supported = supported && (op <= probe->last_op) && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported) {
+        Printer::elog(E_TASK, "io_uring lacks the operations we need; file operations will go through the async threads");
+        return false;
+    }
+
+    m_sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    m_cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+    m_sqRing = mmap(NULL, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+    if (m_sqRing == MAP_FAILED) {
+        m_sqRing = NULL;
+        return false;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        m_cqRing = m_sqRing;
+    } else {
+        m_cqRing = mmap(NULL, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) {
+            m_cqRing = NULL;
+            return false;
+        }
+    }
+    m_sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    m_sqes = (struct io_uring_sqe *) mmap(NULL, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+    if (m_sqes == MAP_FAILED) {
+        m_sqes = NULL;
+        return false;
+    }
+
+    m_sqHead = ringPtr<unsigned>(m_sqRing, p.sq_off.head);
+    m_sqTail = ringPtr<unsigned>(m_sqRing, p.sq_off.tail);
+    m_sqMask = ringPtr<unsigned>(m_sqRing, p.sq_off.ring_mask);
+    m_sqArray = ringPtr<unsigned>(m_sqRing, p.sq_off.array);
+    m_cqHead = ringPtr<unsigned>(m_cqRing, p.cq_off.head);
+    m_cqTail = ringPtr<unsigned>(m_cqRing, p.cq_off.tail);
+    m_cqMask = ringPtr<unsigned>(m_cqRing, p.cq_off.ring_mask);
+    m_cqes = ringPtr<struct io_uring_cqe>(m_cqRing, p.cq_off.cqes);
+    m_sqEntries = p.sq_entries;
+    m_cqEntries = p.cq_entries;
+    m_sqLocalTail = *m_sqTail;
+
+    m_eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_eventfd < 0)
+        return false;
+    if (io_uring_register(m_fd, IORING_REGISTER_EVENTFD, &m_eventfd, 1) < 0)
+        return false;
+    m_evt.set(m_loop);
+    m_evt.set<IoUring, &IoUring::evt_cb>(this);
+    m_evt.set(m_eventfd, ev::READ);
+    m_evt.start();
+
+    Printer::elog(E_TASK, "io_uring %i set up with %u entries", m_fd, m_sqEntries);
+    return true;
+}
+
+Balau::IoUring::~IoUring() {
+    // the kernel may still write into buffers of requests in flight; wait for them, but there's nobody left to signal.
+    if (m_inFlight)
+        submit();
+    while (m_inFlight && (io_uring_enter(m_fd, 0, 1, IORING_ENTER_GETEVENTS) >= 0 || errno == EINTR))
+        reap(false);
+    m_evt.stop();
+    if (m_sqes)
+        munmap(m_sqes, m_sqesSize);
+    if (m_cqRing && (m_cqRing != m_sqRing))
+        munmap(m_cqRing, m_cqRingSize);
+    if (m_sqRing)
+        munmap(m_sqRing, m_sqRingSize);
+    if (m_eventfd >= 0)
+        close(m_eventfd);
+    if (m_fd >= 0)
+        close(m_fd);
+}
+
+struct io_uring_sqe * Balau::IoUring::getSQE(IoResults * r, int opcode) {
+    // a completion that doesn't fit in its ring is dropped, or held back by the kernel until we make room; never
+    // have more in flight than the completion ring can hold.
+    if (m_inFlight >= (int) m_cqEntries)
+        return NULL;
+    // we're the only ones writing the tail; the kernel moves the head as it consumes entries.
+    unsigned tail = m_sqLocalTail;
+    unsigned head = __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE);
+    if ((tail - head) >= m_sqEntries)
+        return NULL;
+    unsigned idx = tail & *m_sqMask;
+    struct io_uring_sqe * sqe = m_sqes + idx;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = (uint64_t) (uintptr_t) r;
+    m_sqArray[idx] = idx;
+    // the caller still has to fill the entry in; the tail gets published in submit().
+    m_sqLocalTail = tail + 1;
+    m_toSubmit++;
+    m_inFlight++;
+    return sqe;
+}
+
+bool Balau::IoUring::prepOpen(IoResults * r, const char * path, int flags, mode_t mode) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_OPENAT);
+    if (!sqe)
+        return false;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uint64_t) (uintptr_t) path;
+    sqe->len = mode;
+    sqe->open_flags = flags;
+    return true;
+}
+
+bool Balau::IoUring::prepStat(IoResults * r, int fd, struct statx * stx) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_STATX);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) "";
+    sqe->len = STATX_SIZE | STATX_MTIME;
+    sqe->off = (uint64_t) (uintptr_t) stx;
+    sqe->statx_flags = AT_EMPTY_PATH;
+    return true;
+}
+
+bool Balau::IoUring::prepRead(IoResults * r, int fd, void * buf, size_t count, off64_t offset) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_READ);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = (uint32_t) std::min(count, (size_t) 0x7ffff000);
+    sqe->off = offset;
+    return true;
+}
+
+bool Balau::IoUring::prepWrite(IoResults * r, int fd, const void * buf, size_t count, off64_t offset) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_WRITE);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) buf;
+    sqe->len = (uint32_t) std::min(count, (size_t) 0x7ffff000);
+    sqe->off = offset;
+    return true;
+}
+
+bool Balau::IoUring::prepReadv(IoResults * r, int fd, const struct iovec * iov, int iovcnt, off64_t offset) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_READV);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    return true;
+}
+
+bool Balau::IoUring::prepWritev(IoResults * r, int fd, const struct iovec * iov, int iovcnt, off64_t offset) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_WRITEV);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) iov;
+    sqe->len = iovcnt;
+    sqe->off = offset;
+    return true;
+}
+
+bool Balau::IoUring::prepClose(IoResults * r, int fd) {
+    struct io_uring_sqe * sqe = getSQE(r, IORING_OP_CLOSE);
+    if (!sqe)
+        return false;
+    sqe->fd = fd;
+    return true;
+}
+
+bool Balau::IoUring::submit() {
+    if (m_toSubmit)
+        __atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+    while (m_toSubmit) {
+        int r = io_uring_enter(m_fd, m_toSubmit, 0, 0);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN or EBUSY: the kernel is short on resources, or the completion ring is full; try again later.
+            Printer::elog(E_TASK, "io_uring_enter failed with errno %i; %u entries left to submit", errno, m_toSubmit);
+            return false;
+        }
+        m_toSubmit -= r;
+    }
+    return true;
+}
+
+void Balau::IoUring::reap(bool signal) {
+    unsigned head = *m_cqHead;
+    unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe * cqe = m_cqes + (head & *m_cqMask);
+        IoResults * r = (IoResults *) (uintptr_t) cqe->user_data;
+        head++;
+        m_inFlight--;
+        m_completed++;
+        if (!signal)
+            continue;
+        r->result = cqe->res < 0 ? -1 : cqe->res;
+        r->errorno = cqe->res < 0 ? -cqe->res : 0;
+        r->evt.doSignal();
+    }
+    __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+}
+
+void Balau::IoUring::evt_cb(ev::io & w, int revents) {
+    eventfd_t v;
+    eventfd_read(m_eventfd, &v);
+    reap(true);
+}
+
+#endif
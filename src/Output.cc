@@ -3,28 +3,44 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <algorithm>
 #ifndef _MSC_VER
 #include <unistd.h>
 #else
 #include <io.h>
 #endif
 #include "Async.h"
+#include "FreeList.h"
 #include "Output.h"
+#include "IoUring.h"
 #include "Task.h"
 #include "TaskMan.h"
 #include "Printer.h"
 
 namespace {
 
-struct cbResults_t {
-    Balau::Events::Custom evt;
-    ssize_t result;
-    int errorno;
+struct cbResults_t : public Balau::IoResults, public Balau::Pooled<cbResults_t> {
     struct stat statdata;
-    enum { NONE, OPEN, STAT, CLOSE, WRITE } type;
+#ifdef HAVE_IO_URING
+    struct statx statxdata;
+    bool viaRing = false;
+#endif
+    enum { NONE, OPEN, STAT, CLOSE, WRITE, SYNC } type;
+    // the operation running on the async threads, until its done()
+    Balau::AsyncOperation * op = NULL;
 };
 
-class AsyncOpOpen : public Balau::AsyncOperation {
+void completed(cbResults_t * results, bool skipped) {
+    results->op = NULL;
+    if (skipped) {
+        results->result = -1;
+        results->errorno = ECANCELED;
+    }
+    results->evt.doSignal();
+}
+
+class AsyncOpOpen : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpOpen> {
   public:
       AsyncOpOpen(const char * path, bool truncate, cbResults_t * results) : m_path(path), m_truncate(truncate), m_results(results) { }
     virtual void run() {
@@ -36,7 +52,7 @@ class AsyncOpOpen : public Balau::AsyncOperation {
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -45,15 +61,16 @@ class AsyncOpOpen : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
-class AsyncOpStat : public Balau::AsyncOperation {
+class AsyncOpStat : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpStat> {
   public:
       AsyncOpStat(int fd, cbResults_t * results) : m_fd(fd), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
         const ssize_t r = m_results->result = fstat(m_fd, &m_results->statdata);
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -61,6 +78,44 @@ class AsyncOpStat : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
+#ifdef HAVE_IO_URING
+// the ring of the TaskMan we're running on, if it could set one up.
+Balau::IoUring * ioUring() {
+    Balau::Task * t = Balau::Task::getCurrentTask();
+    return t ? t->getTaskMan()->getIoUring() : NULL;
+}
+#endif
+
+void queueOpen(const char * path, bool truncate, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepOpen(results, path, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0), 0755))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpOpen(path, truncate, results));
+}
+
+void queueStat(int fd, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepStat(results, fd, &results->statxdata)) {
+        results->viaRing = true;
+        return;
+    }
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpStat(fd, results));
+}
+
+// the ring gives us a statx; fill the few fields we use in statdata.
+void gotStat(cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    if (results->viaRing) {
+        results->statdata.st_size = results->statxdata.stx_size;
+        results->statdata.st_mtime = results->statxdata.stx_mtime.tv_sec;
+    }
+#endif
+}
+
 };
 
 Balau::Output::Output(const char * fname) {
@@ -91,7 +146,7 @@ void Balau::Output::open(bool truncate) throw (GeneralException) {
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::OPEN;
-            createAsyncOp(new AsyncOpOpen(m_fname.to_charp(), truncate, cbResults));
+            queueOpen(m_fname.to_charp(), truncate, cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::OPEN:
             AAssert(isPendingComplete(), "Don't call open again without checking isPendingComplete.");
@@ -109,9 +164,10 @@ void Balau::Output::open(bool truncate) throw (GeneralException) {
             delete cbResults;
             m_pendingOp = cbResults = new cbResults_t();
             cbResults->type = cbResults_t::STAT;
-            createAsyncOp(new AsyncOpStat(m_fd, cbResults));
+            queueStat(m_fd, cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::STAT:
+            gotStat(cbResults);
             if (cbResults->result == 0) {
                 m_size = cbResults->statdata.st_size;
                 m_mtime = cbResults->statdata.st_mtime;
@@ -138,15 +194,16 @@ void Balau::Output::open(bool truncate) throw (GeneralException) {
 
 namespace {
 
-class AsyncOpClose : public Balau::AsyncOperation {
+class AsyncOpClose : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpClose> {
   public:
       AsyncOpClose(int fd, cbResults_t * results) : m_fd(fd), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
         const ssize_t r = m_results->result = close(m_fd);
         m_results->errorno = r < 0 ? errno : 0;
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
@@ -154,6 +211,15 @@ class AsyncOpClose : public Balau::AsyncOperation {
     cbResults_t * m_results;
 };
 
+void queueClose(int fd, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ring->prepClose(results, fd))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpClose(fd, results));
+}
+
 };
 
 void Balau::Output::close() throw (GeneralException) {
@@ -169,11 +235,29 @@ void Balau::Output::close() throw (GeneralException) {
         cbResults = (cbResults_t *) m_pendingOp;
     }
 
+    // don't close the fd from under an operation still in flight; cancel it, which skips it entirely if no worker
+    // got to it yet, and wait for it to be over.
+    if ((cbResults->type != cbResults_t::NONE) && (cbResults->type != cbResults_t::CLOSE)) {
+        if (!cbResults->evt.gotSignal()) {
+            if (cbResults->op)
+                cbResults->op->cancel();
+            Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
+        }
+        if ((cbResults->type == cbResults_t::OPEN) && (cbResults->result >= 0))
+            m_fd = (int) cbResults->result;
+        delete cbResults;
+        m_pendingOp = NULL;
+        if (m_fd < 0)
+            return;
+        m_pendingOp = cbResults = new cbResults_t;
+        cbResults->type = cbResults_t::NONE;
+    }
+
     try {
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::CLOSE;
-            createAsyncOp(new AsyncOpClose(m_fd, cbResults));
+            queueClose(m_fd, cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::CLOSE:
             m_fd = -1;
@@ -204,10 +288,18 @@ void Balau::Output::close() throw (GeneralException) {
 
 namespace {
 
-class AsyncOpWrite : public Balau::AsyncOperation {
+class AsyncOpWrite : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpWrite> {
   public:
-      AsyncOpWrite(int fd, const void * buf, size_t count, off64_t offset, cbResults_t * results) : m_fd(fd), m_buf(buf), m_count(count), m_offset(offset), m_results(results) { }
+      AsyncOpWrite(int fd, const struct iovec * iov, int iovcnt, off64_t offset, cbResults_t * results) : m_fd(fd), m_iov(iov), m_iovcnt(iovcnt), m_offset(offset), m_results(results) {
+          // a lone buffer is copied, so write() can give us its iovec off the stack.
+          if (iovcnt == 1) {
+              m_single = iov[0];
+              m_iov = &m_single;
+          }
+      }
+    virtual intptr_t orderingKey() { return m_fd; }
     virtual void run() {
+#if defined(_MSC_VER) || defined(__APPLE__)
 #ifdef _MSC_VER
         off64_t offset = _lseeki64(m_fd, m_offset, SEEK_SET);
         if (offset < 0) {
@@ -215,27 +307,61 @@ class AsyncOpWrite : public Balau::AsyncOperation {
             m_results->errorno = errno;
             return;
         }
-        const ssize_t r = m_results->result = write(m_fd, m_buf, m_count);
+#endif
+        ssize_t total = 0, r = 0;
+        for (int i = 0; i < m_iovcnt; i++) {
+#ifdef _MSC_VER
+            r = write(m_fd, m_iov[i].iov_base, m_iov[i].iov_len);
 #else
-        const ssize_t r = m_results->result = pwrite(m_fd, m_buf, m_count, m_offset);
+            r = pwrite(m_fd, m_iov[i].iov_base, m_iov[i].iov_len, m_offset + total);
 #endif
+            if (r < 0)
+                break;
+            total += r;
+            if ((size_t) r < m_iov[i].iov_len)
+                break;
+        }
+        m_results->result = ((r < 0) && (total == 0)) ? -1 : total;
+        m_results->errorno = ((r < 0) && (total == 0)) ? errno : 0;
+#else
+        const ssize_t r = m_results->result = m_iovcnt == 1 ? pwrite(m_fd, m_single.iov_base, m_single.iov_len, m_offset) : pwritev(m_fd, m_iov, m_iovcnt, m_offset);
         m_results->errorno = r < 0 ? errno : 0;
+#endif
     }
     virtual void done() {
-        m_results->evt.doSignal();
+        completed(m_results, wasSkipped());
         delete this;
     }
   private:
     int m_fd;
-    const void * m_buf;
-    size_t m_count;
+    const struct iovec * m_iov;
+    struct iovec m_single;
+    int m_iovcnt;
     off64_t m_offset;
     cbResults_t * m_results;
 };
 
+void queueWrite(int fd, const struct iovec * iov, int iovcnt, off64_t offset, cbResults_t * results) {
+#ifdef HAVE_IO_URING
+    Balau::IoUring * ring = ioUring();
+    if (ring && ((iovcnt == 1) ? ring->prepWrite(results, fd, iov[0].iov_base, iov[0].iov_len, offset) : ring->prepWritev(results, fd, iov, iovcnt, offset)))
+        return;
+#endif
+    results->op = Balau::createAsyncOp(new AsyncOpWrite(fd, iov, iovcnt, offset, results));
+}
+
 };
 
 ssize_t Balau::Output::write(const void * buf, size_t count) throw (GeneralException) {
+    struct iovec iov = { const_cast<void *>(buf), count };
+    return writeInternal(&iov, 1);
+}
+
+ssize_t Balau::Output::writev(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    return writeInternal(iov, std::min(iovcnt, IOV_MAX));
+}
+
+ssize_t Balau::Output::writeInternal(const struct iovec * iov, int iovcnt) throw (GeneralException) {
     AAssert(!isClosed(), "Can't write a closed file");
     ssize_t result;
 
@@ -252,7 +378,7 @@ ssize_t Balau::Output::write(const void * buf, size_t count) throw (GeneralExcep
         switch (cbResults->type) {
         case cbResults_t::NONE:
             cbResults->type = cbResults_t::WRITE;
-            createAsyncOp(new AsyncOpWrite(m_fd, buf, count, getWOffset(), cbResults));
+            queueWrite(m_fd, iov, iovcnt, getWOffset(), cbResults);
             Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
         case cbResults_t::WRITE:
             result = cbResults->result;
@@ -286,6 +412,140 @@ ssize_t Balau::Output::write(const void * buf, size_t count) throw (GeneralExcep
     return -1;
 }
 
+namespace {
+
+enum SyncType { FULL_SYNC, DATA_SYNC, PREALLOCATE, PREALLOCATE_KEEP_SIZE };
+
+class AsyncOpSync : public Balau::AsyncOperation, public Balau::Pooled<AsyncOpSync> {
+  public:
+      AsyncOpSync(int fd, SyncType syncType, off64_t size, cbResults_t * results) : m_fd(fd), m_syncType(syncType), m_size(size), m_results(results) { }
+    virtual intptr_t orderingKey() { return m_fd; }
+    virtual void run() {
+        int r = 0, err = 0;
+        switch (m_syncType) {
+        case FULL_SYNC:
+        case DATA_SYNC:
+#ifdef _MSC_VER
+            r = _commit(m_fd);
+#elif defined(__APPLE__)
+            r = fsync(m_fd);
+#else
+            r = m_syncType == DATA_SYNC ? fdatasync(m_fd) : fsync(m_fd);
+#endif
+            err = r < 0 ? errno : 0;
+            break;
+        case PREALLOCATE:
+        case PREALLOCATE_KEEP_SIZE:
+#if defined(__linux__)
+            r = fallocate(m_fd, m_syncType == PREALLOCATE_KEEP_SIZE ? FALLOC_FL_KEEP_SIZE : 0, 0, m_size);
+            // some filesystems can't, and say EOPNOTSUPP; posix_fallocate would then write zeroes all over, which
+            // isn't what we want, so that's left for the caller to decide.
+            err = r < 0 ? errno : 0;
+#elif defined(__APPLE__)
+            {
+                fstore_t store = { F_ALLOCATEALL, F_PEOFPOSMODE, 0, m_size, 0 };
+                r = fcntl(m_fd, F_PREALLOCATE, &store);
+                err = r < 0 ? errno : 0;
+                if (err == ENOTSUP)
+                    err = EOPNOTSUPP;
+                if ((r == 0) && (m_syncType == PREALLOCATE)) {
+                    r = ftruncate(m_fd, m_size);
+                    err = r < 0 ? errno : 0;
+                }
+            }
+#elif !defined(_MSC_VER)
+            // posix_fallocate always grows the file, so it can't keep its size.
+            if (m_syncType == PREALLOCATE) {
+                err = posix_fallocate(m_fd, 0, m_size);
+                r = err ? -1 : 0;
+            } else {
+                r = -1;
+                err = EOPNOTSUPP;
+            }
+#else
+            r = -1;
+            err = EOPNOTSUPP;
+#endif
+            break;
+        }
+        m_results->result = r;
+        m_results->errorno = err;
+    }
+    virtual void done() {
+        completed(m_results, wasSkipped());
+        delete this;
+    }
+  private:
+    int m_fd;
+    SyncType m_syncType;
+    off64_t m_size;
+    cbResults_t * m_results;
+};
+
+};
+
+void Balau::Output::sync() throw (GeneralException) {
+    syncOp(FULL_SYNC, 0, "sync");
+}
+
+void Balau::Output::datasync() throw (GeneralException) {
+    syncOp(DATA_SYNC, 0, "datasync");
+}
+
+bool Balau::Output::preallocate(off64_t size, bool keepSize) throw (GeneralException) {
+    bool reserved = syncOp(keepSize ? PREALLOCATE_KEEP_SIZE : PREALLOCATE, size, "preallocate");
+    if (reserved && !keepSize && (size > m_size))
+        m_size = size;
+    return reserved;
+}
+
+bool Balau::Output::syncOp(int syncType, off64_t size, const char * what) throw (GeneralException) {
+    AAssert(!isClosed(), "Can't %s a closed file", what);
+
+    cbResults_t * cbResults;
+    bool done = true;
+
+    if (!m_pendingOp) {
+        m_pendingOp = cbResults = new cbResults_t;
+        cbResults->type = cbResults_t::NONE;
+    } else {
+        cbResults = (cbResults_t *) m_pendingOp;
+    }
+
+    try {
+        switch (cbResults->type) {
+        case cbResults_t::NONE:
+            cbResults->type = cbResults_t::SYNC;
+            cbResults->op = createAsyncOp(new AsyncOpSync(m_fd, (SyncType) syncType, size, cbResults));
+            Task::operationYield(&cbResults->evt, Task::INTERRUPTIBLE);
+        case cbResults_t::SYNC:
+            if ((cbResults->result < 0) && (cbResults->errorno == EOPNOTSUPP) && ((syncType == PREALLOCATE) || (syncType == PREALLOCATE_KEEP_SIZE))) {
+                done = false;
+            } else if (cbResults->result < 0) {
+                char str[4096];
+                throw GeneralException(String("Unable to ") + what + " file " + m_name + ": " + strerror_ts(cbResults->errorno, str, sizeof(str)) + " (err#" + cbResults->errorno + ")");
+            }
+            delete cbResults;
+            m_pendingOp = NULL;
+            break;
+        default:
+            AAssert(false, "Don't switch operations while one is still not complete.");
+        }
+    }
+    catch (Balau::TaskSwitch) {
+        throw;
+    }
+    catch (Balau::EAgain) {
+        throw;
+    }
+    catch (...) {
+        delete cbResults;
+        m_pendingOp = NULL;
+        throw;
+    }
+    return done;
+}
+
 bool Balau::Output::isClosed() {
     return m_fd < 0;
 }
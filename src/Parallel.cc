@@ -0,0 +1,60 @@
+#include "Parallel.h"
+#include "TaskMan.h"
+
+class Balau::ParallelJob::Chunk : public AsyncOperation {
+  public:
+      Chunk(ParallelJob * job, size_t chunk) : m_job(job), m_chunk(chunk) { }
+  protected:
+    virtual void run() { m_job->chunkRun(m_chunk); }
+    virtual void done() { m_job->chunkDone(); delete this; }
+    virtual bool needsMainQueue() { return false; }
+    virtual bool needsFinishWorker() { return true; }
+  private:
+    ParallelJob * m_job;
+    size_t m_chunk;
+};
+
+size_t Balau::ParallelJob::maxChunks() {
+    return AsyncManager::getCPUCount() * 4;
+}
+
+void Balau::ParallelJob::runAll() {
+    Task * t = Task::getCurrentTask();
+    AAssert(t, "A parallel job needs to be run from a task.");
+    AAssert(m_pending == 0, "Can't run a parallel job twice at once.");
+    Printer::elog(E_ASYNC, "Running parallel job %p in %zu chunks", this, m_chunks);
+    m_evt.registerOwner(t);
+    m_pending = m_chunks;
+    for (size_t i = 0; i < m_chunks; i++)
+        createAsyncOp(new Chunk(this, i));
+    // done() gets called from our own TaskMan, so only the last chunk signals us.
+    while (m_pending != 0)
+        Task::operationYield(&m_evt, Task::SIMPLE);
+    m_evt.reset();
+    Printer::elog(E_ASYNC, "Parallel job %p is done", this);
+    if (m_exception) {
+        std::exception_ptr e = m_exception;
+        m_exception = nullptr;
+        m_failed = false;
+        std::rethrow_exception(e);
+    }
+}
+
+void Balau::ParallelJob::chunkRun(size_t chunk) {
+    if (m_failed.load(std::memory_order_relaxed))
+        return;
+    try {
+        runChunk(chunk);
+    }
+    catch (...) {
+        ScopeLock sl(m_exceptionLock);
+        if (!m_exception)
+            m_exception = std::current_exception();
+        m_failed = true;
+    }
+}
+
+void Balau::ParallelJob::chunkDone() {
+    if (--m_pending == 0)
+        m_evt.doSignal();
+}
@@ -0,0 +1,115 @@
+#include <string.h>
+#include "SegmentedBuffer.h"
+
+ssize_t Balau::SegmentedBuffer::read(void * buf, size_t count) throw (GeneralException) {
+    off64_t cursor = rtell();
+    if (cursor >= m_size)
+        return 0;
+    size_t avail = m_size - cursor;
+
+    if (count > avail)
+        count = avail;
+
+    uint8_t * dst = (uint8_t *) buf;
+    size_t left = count;
+    while (left) {
+        size_t offset = cursor % SEGMENT_SIZE;
+        size_t chunk = SEGMENT_SIZE - offset;
+        if (chunk > left)
+            chunk = left;
+        memcpy(dst, m_segments[cursor / SEGMENT_SIZE]->data + offset, chunk);
+        dst += chunk;
+        cursor += chunk;
+        left -= chunk;
+    }
+
+    rseek(cursor);
+
+    return count;
+}
+
+ssize_t Balau::SegmentedBuffer::write(const void * buf, size_t count) throw (GeneralException) {
+    off64_t cursor = wtell();
+    off64_t end = cursor + count;
+    size_t endSegment = (end + SEGMENT_SIZE - 1) / SEGMENT_SIZE;
+
+    while (m_segments.size() < endSegment)
+        m_segments.push_back(new Segment);
+
+    // only a seek past the end leaves a hole, and only the hole needs zeroing.
+    for (off64_t hole = m_size; hole < cursor;) {
+        size_t offset = hole % SEGMENT_SIZE;
+        size_t chunk = SEGMENT_SIZE - offset;
+        if ((off64_t) chunk > cursor - hole)
+            chunk = cursor - hole;
+        memset(m_segments[hole / SEGMENT_SIZE]->data + offset, 0, chunk);
+        hole += chunk;
+    }
+
+    const uint8_t * src = (const uint8_t *) buf;
+    size_t left = count;
+    while (left) {
+        size_t offset = cursor % SEGMENT_SIZE;
+        size_t chunk = SEGMENT_SIZE - offset;
+        if (chunk > left)
+            chunk = left;
+        memcpy(m_segments[cursor / SEGMENT_SIZE]->data + offset, src, chunk);
+        src += chunk;
+        cursor += chunk;
+        left -= chunk;
+    }
+
+    wseek(cursor);
+
+    if (m_size < end)
+        m_size = end;
+
+    return count;
+}
+
+ssize_t Balau::SegmentedBuffer::transferTo(IO<Handle> dest, size_t count) throw (GeneralException) {
+    off64_t cursor = rtell();
+    if ((cursor >= m_size) || (count == 0))
+        return 0;
+
+    struct iovec iov[16];
+    int n = getSegments(iov, 16, cursor);
+    size_t total = 0;
+    for (int i = 0; i < n; i++) {
+        if (iov[i].iov_len >= count - total) {
+            iov[i].iov_len = count - total;
+            n = i + 1;
+        }
+        total += iov[i].iov_len;
+    }
+
+    ssize_t r = dest->writev(iov, n);
+    if (r > 0)
+        rseek(cursor + r);
+
+    return r;
+}
+
+int Balau::SegmentedBuffer::getSegments(struct iovec * iov, int iovcnt, off64_t offset) {
+    int n = 0;
+    while ((n < iovcnt) && (offset < m_size)) {
+        size_t inSegment = offset % SEGMENT_SIZE;
+        size_t len = SEGMENT_SIZE - inSegment;
+        if ((off64_t) len > m_size - offset)
+            len = m_size - offset;
+        iov[n].iov_base = m_segments[offset / SEGMENT_SIZE]->data + inSegment;
+        iov[n].iov_len = len;
+        offset += len;
+        n++;
+    }
+    return n;
+}
+
+void Balau::SegmentedBuffer::reset() {
+    for (Segment * s : m_segments)
+        delete s;
+    m_segments.clear();
+    m_size = 0;
+    wseek(0);
+    rseek(0);
+}
@@ -11,6 +11,9 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "Selectable.h"
 #include "Threads.h"
 #include "Printer.h"
@@ -87,26 +90,26 @@ Balau::Selectable::~Selectable() {
 bool Balau::Selectable::isClosed() { return m_fd < 0; }
 bool Balau::Selectable::isEOF() { return isClosed(); }
 
-ssize_t Balau::Selectable::read(void * buf, size_t count) throw (GeneralException) {
-    if (count == 0)
-        return 0;
-
-    AAssert(m_fd >= 0, "You can't call read() on a closed selectable");
-
+// runs the syscall until it doesn't fail with EAGAIN anymore, waiting on evt in between; it may be tried up to three
+// times. A peer that went away on a write closes us, and returns 0.
+template<class F>
+ssize_t Balau::Selectable::retryIO(SelectableEvent * evt, F syscall) {
     int spins = 0;
 
     do {
-        ssize_t r = recv((int) getSocket(m_fd), (char *) buf, count, 0);
+        ssize_t r = syscall();
 
         if (r >= 0) {
-            m_evtR->resetMaybe();
-            if (r == 0)
-                close();
+            evt->resetMaybe();
             return r;
         }
 
 #ifndef _WIN32
         int err = errno;
+        if (err == EPIPE) {
+            close();
+            return 0;
+        }
 #else
         int err = WSAGetLastError();
 #ifdef _MSC_VER
@@ -118,9 +121,9 @@ ssize_t Balau::Selectable::read(void * buf, size_t count) throw (GeneralExceptio
 #endif
 
         if ((err == EAGAIN) || (err == EINTR) || (err == EWOULDBLOCK)) {
-            Task::operationYield(m_evtR, Task::INTERRUPTIBLE);
+            Task::operationYield(evt, Task::INTERRUPTIBLE);
         } else {
-            m_evtR->stop();
+            evt->stop();
             return r;
         }
     } while (spins++ < 2);
@@ -128,47 +131,65 @@ ssize_t Balau::Selectable::read(void * buf, size_t count) throw (GeneralExceptio
     return -1;
 }
 
+ssize_t Balau::Selectable::read(void * buf, size_t count) throw (GeneralException) {
+    struct iovec iov = { buf, count };
+    return Selectable::readv(&iov, 1);
+}
+
 ssize_t Balau::Selectable::write(const void * buf, size_t count) throw (GeneralException) {
-    if (count == 0)
+    struct iovec iov = { const_cast<void *>(buf), count };
+    return Selectable::writev(&iov, 1);
+}
+
+ssize_t Balau::Selectable::recvv(int sockfd, const struct iovec * iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len)
+            return recv(sockfd, iov[i].iov_base, iov[i].iov_len, 0);
+    return 0;
+}
+
+ssize_t Balau::Selectable::sendv(int sockfd, const struct iovec * iov, int iovcnt) {
+    for (int i = 0; i < iovcnt; i++)
+        if (iov[i].iov_len)
+            return send(sockfd, iov[i].iov_base, iov[i].iov_len, 0);
+    return 0;
+}
+
+ssize_t Balau::Selectable::readv(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    if (iovSize(iov, iovcnt) == 0)
         return 0;
 
-    AAssert(m_fd >= 0, "You can't call write() on a closed selectable");
+    AAssert(m_fd >= 0, "You can't read from a closed selectable");
 
-    int spins = 0;
+    ssize_t r = retryIO(m_evtR, [&]() { return recvv((int) getSocket(m_fd), iov, iovcnt); });
+    if (r == 0)
+        close();
+    return r;
+}
 
-    do {
-        ssize_t r = send((int) getSocket(m_fd), (const char *) buf, count, 0);
+ssize_t Balau::Selectable::writev(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    if (iovSize(iov, iovcnt) == 0)
+        return 0;
 
-        EAssert(r != 0, "send() returned 0 (broken pipe ?)");
+    AAssert(m_fd >= 0, "You can't write to a closed selectable");
 
-        if (r > 0) {
-            m_evtW->resetMaybe();
-            return r;
-        }
+    return retryIO(m_evtW, [&]() {
+        ssize_t r = sendv((int) getSocket(m_fd), iov, iovcnt);
+        EAssert(r != 0, "sendv() returned 0 (broken pipe ?)");
+        return r;
+    });
+}
 
-#ifndef _WIN32
-        int err = errno;
-        if (err == EPIPE) {
-            close();
-            return 0;
-        }
-#else
-        int err = WSAGetLastError();
-#ifdef _MSC_VER
-        if (err == WSAEWOULDBLOCK)
-#else
-        if (err == WSAWOULDBLOCK)
-#endif
-            err = EAGAIN;
-#endif
+#ifdef __linux__
+ssize_t Balau::Selectable::receiveFile(int fd, off64_t offset, size_t count) throw (GeneralException) {
+    if (count == 0)
+        return 0;
 
-        if ((err == EAGAIN) || (err == EINTR) || (err == EWOULDBLOCK)) {
-            Task::operationYield(m_evtW, Task::INTERRUPTIBLE);
-        } else {
-            m_evtW->stop();
-            return r;
-        }
-    } while (spins++ < 2);
+    AAssert(m_fd >= 0, "You can't call receiveFile() on a closed selectable");
 
-    return -1;
+    return retryIO(m_evtW, [&]() {
+        off_t off = offset;
+        return sendfile(m_fd, fd, &off, count);
+    });
 }
+#endif
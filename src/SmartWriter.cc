@@ -4,7 +4,7 @@
 
 namespace {
 
-struct WriteCell {
+struct WriteCell : public Balau::QueueNode {
       ~WriteCell() { free(buffer); }
     void * buffer = NULL;
     uint8_t * ptr;
@@ -128,7 +128,8 @@ ssize_t Balau::SmartWriter::write(const void * _buf, size_t count) throw (Balau:
             r = Filter::write(buf, count);
         }
         catch (EAgain &) {
-            m_writerTask = TaskMan::registerTask(new SmartWriterTask(getIO()));
+            // keep the writer on the same TaskMan as its producer, so the buffers stay cache-warm.
+            m_writerTask = TaskMan::registerTask(new SmartWriterTask(getIO()), Task::getCurrentTask());
         }
         if (r < 0)
             return r;
@@ -138,3 +139,26 @@ ssize_t Balau::SmartWriter::write(const void * _buf, size_t count) throw (Balau:
 
     return r;
 }
+
+ssize_t Balau::SmartWriter::writev(const struct iovec * iov, int iovcnt) throw (Balau::GeneralException) {
+    if (!m_writerTask) {
+        try {
+            return getIO()->writev(iov, iovcnt);
+        }
+        catch (EAgain &) {
+            m_writerTask = TaskMan::registerTask(new SmartWriterTask(getIO()), Task::getCurrentTask());
+        }
+    }
+
+    // once the writer task is there, everything goes through its queue to keep the ordering.
+    if (m_writerTask->gotError())
+        return -1;
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        if (iov[i].iov_len == 0)
+            continue;
+        m_writerTask->queueWrite(iov[i].iov_base, iov[i].iov_len);
+        total += iov[i].iov_len;
+    }
+    return total;
+}
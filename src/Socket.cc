@@ -14,6 +14,9 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
 #include "Socket.h"
 #include "Threads.h"
 #include "Printer.h"
@@ -506,6 +509,16 @@ ssize_t Balau::Socket::write(const void * buf, size_t count) throw (GeneralExcep
     return Selectable::write(buf, count);
 }
 
+ssize_t Balau::Socket::readv(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    AAssert(m_connected, "You can't call readv() on a non-connected socket");
+    return Selectable::readv(iov, iovcnt);
+}
+
+ssize_t Balau::Socket::writev(const struct iovec * iov, int iovcnt) throw (GeneralException) {
+    AAssert(m_connected, "You can't call writev() on a non-connected socket");
+    return Selectable::writev(iov, iovcnt);
+}
+
 ssize_t Balau::Socket::recv(int sockfd, void *buf, size_t len, int flags) {
     ssize_t r = ::recv(sockfd, (char *) buf, len, flags);
     if (r < 0) {
@@ -522,6 +535,24 @@ ssize_t Balau::Socket::send(int sockfd, const void *buf, size_t len, int flags)
     return ::send(sockfd, (const char *) buf, len, flags);
 }
 
+#ifndef _WIN32
+ssize_t Balau::Socket::recvv(int sockfd, const struct iovec * iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = std::min(iovcnt, IOV_MAX);
+    return ::recvmsg(sockfd, &msg, 0);
+}
+
+ssize_t Balau::Socket::sendv(int sockfd, const struct iovec * iov, int iovcnt) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = const_cast<struct iovec *>(iov);
+    msg.msg_iovlen = std::min(iovcnt, IOV_MAX);
+    return ::sendmsg(sockfd, &msg, 0);
+}
+#endif
+
 Balau::ListenerBase::ListenerBase(int port, const char * local, void * opaque) : m_listener(new Socket()), m_stop(false), m_local(local), m_port(port), m_opaque(opaque) {
     m_name = String("Listener for something - Starting on ") + local + ":" + port;
     Printer::elog(E_SOCKET, "Created a listener task at %p (%s)", this, m_name.to_charp());
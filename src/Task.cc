@@ -39,6 +39,135 @@ static void CALLBACK trampoline(void * arg) {
     s_trampoline(arg);
 }
 
+#ifdef BALAU_ASM_CONTEXT
+// balau_switch_context(from, to) saves the callee-saved registers on the current stack, stores the resulting stack
+// pointer into *from, then restores the registers saved on the stack pointed by to, and returns there.
+// A new stack is prepared so that the first switch to it 'returns' into balau_context_entry, which calls the
+// function in r12 / x19 with the argument in r13 / x20.
+extern "C" void balau_switch_context(void ** from, void * to);
+extern "C" void balau_context_entry();
+
+#if defined(__x86_64__)
+__asm__(
+    ".text\n"
+    ".globl balau_switch_context\n"
+    ".hidden balau_switch_context\n"
+    ".type balau_switch_context, @function\n"
+    ".p2align 4\n"
+    "balau_switch_context:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size balau_switch_context, .-balau_switch_context\n"
+    ".globl balau_context_entry\n"
+    ".hidden balau_context_entry\n"
+    ".type balau_context_entry, @function\n"
+    ".p2align 4\n"
+    "balau_context_entry:\n"
+    "    movq %r13, %rdi\n"
+    "    callq *%r12\n"
+    "    ud2\n"
+    ".size balau_context_entry, .-balau_context_entry\n"
+);
+
+static void * prepareStack(void * stack, size_t size, trampoline_t func, void * arg) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~static_cast<uintptr_t>(15);
+    // the return address sits so that %rsp is 16-bytes aligned once we're in balau_context_entry.
+    uint64_t * sp = reinterpret_cast<uint64_t *>(top - 24);
+    *sp = reinterpret_cast<uint64_t>(balau_context_entry);
+    *--sp = 0;                                      // rbp
+    *--sp = 0;                                      // rbx
+    *--sp = reinterpret_cast<uint64_t>(func);       // r12
+    *--sp = reinterpret_cast<uint64_t>(arg);        // r13
+    *--sp = 0;                                      // r14
+    *--sp = 0;                                      // r15
+    *--sp = 0x1f80 | (static_cast<uint64_t>(0x037f) << 32); // default mxcsr and x87 control word
+    return sp;
+}
+#elif defined(__aarch64__)
+__asm__(
+    ".text\n"
+    ".globl balau_switch_context\n"
+    ".hidden balau_switch_context\n"
+    ".type balau_switch_context, %function\n"
+    ".p2align 4\n"
+    "balau_switch_context:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    mov sp, x1\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size balau_switch_context, .-balau_switch_context\n"
+    ".globl balau_context_entry\n"
+    ".hidden balau_context_entry\n"
+    ".type balau_context_entry, %function\n"
+    ".p2align 4\n"
+    "balau_context_entry:\n"
+    "    mov x0, x20\n"
+    "    blr x19\n"
+    "    brk #0\n"
+    ".size balau_context_entry, .-balau_context_entry\n"
+);
+
+static void * prepareStack(void * stack, size_t size, trampoline_t func, void * arg) {
+    uintptr_t top = (reinterpret_cast<uintptr_t>(stack) + size) & ~static_cast<uintptr_t>(15);
+    uint64_t * sp = reinterpret_cast<uint64_t *>(top - 160);
+    memset(sp, 0, 160);
+    sp[0] = reinterpret_cast<uint64_t>(func);       // x19
+    sp[1] = reinterpret_cast<uint64_t>(arg);        // x20
+    sp[11] = reinterpret_cast<uint64_t>(balau_context_entry); // x30
+    return sp;
+}
+#endif
+
+void * Balau::prepareContext(void * stack, size_t size, void (*func)(void *), void * arg) {
+    return prepareStack(stack, size, func, arg);
+}
+
+void Balau::switchContext(void ** from, void * to) {
+    balau_switch_context(from, to);
+}
+#endif
+
 #ifdef __APPLE__
 static Balau::Lock signal_lock;
 static jmp_buf sig_jmp_buf;
@@ -76,7 +205,7 @@ void Balau::Task::setup(TaskMan * taskMan, void * stack) {
         IAssert(!stack, "Since we're stackless, no stack should've been allocated.");
         m_stack = NULL;
     } else {
-        size_t size = stackSize();
+        size_t size = m_stackSize;
 #ifndef _WIN32
         IAssert(stack, "Can't setup a coroutine without a stack");
         m_stack = stack;
@@ -98,6 +227,8 @@ void Balau::Task::setup(TaskMan * taskMan, void * stack) {
         signal(SIGUSR2, SIG_DFL);
         memcpy(m_ctx, sig_jmp_buf, sizeof(sig_jmp_buf));
         signal_lock.leave();
+#elif defined(BALAU_ASM_CONTEXT)
+        m_sp = prepareStack(stack, size, trampoline, this);
 #else
         int r = getcontext(&m_ctx);
         RAssert(r == 0, "Unable to get current context: errno = %i", errno);
@@ -122,6 +253,12 @@ void Balau::Task::setup(TaskMan * taskMan, void * stack) {
 }
 
 Balau::Task::~Task() {
+    // nobody will look at what these produce anymore; don't let them hold the workers.
+    while (m_asyncOps) {
+        AsyncOperation * op = m_asyncOps;
+        op->detachFromTask();
+        op->cancel();
+    }
     free(m_tls);
 }
 
@@ -203,6 +340,8 @@ void Balau::Task::coroutine() {
         }
 #elif defined(_WIN32)
         SwitchToFiber(m_taskMan->m_fiber);
+#elif defined(BALAU_ASM_CONTEXT)
+        balau_switch_context(&m_sp, m_taskMan->m_returnSP);
 #else
         swapcontext(&m_ctx, &m_taskMan->m_returnContext);
 #endif
@@ -225,6 +364,8 @@ void Balau::Task::switchTo() {
         }
 #elif defined(_WIN32)
         SwitchToFiber(m_fiber);
+#elif defined(BALAU_ASM_CONTEXT)
+        balau_switch_context(&m_taskMan->m_returnSP, m_sp);
 #else
         swapcontext(&m_taskMan->m_returnContext, &m_ctx);
 #endif
@@ -248,6 +389,8 @@ bool Balau::Task::yield(bool stillRunning) {
         }
 #elif defined(_WIN32)
         SwitchToFiber(m_taskMan->m_fiber);
+#elif defined(BALAU_ASM_CONTEXT)
+        balau_switch_context(&m_sp, m_taskMan->m_returnSP);
 #else
         swapcontext(&m_ctx, &m_taskMan->m_returnContext);
 #endif
@@ -276,16 +419,34 @@ void Balau::Task::sleep(double timeout) {
 }
 
 void Balau::Events::BaseEvent::doSignal() {
-    Printer::elog(E_EVENT, "Event at %p (%s) is signaled with cb %p and task %p", this, ClassName(this).c_str(), m_cb, m_task);
+    Task * t = m_task.load();
+    Printer::elog(E_EVENT, "Event at %p (%s) is signaled with cb %p and task %p", this, ClassName(this).c_str(), m_cb, t);
     m_signal = true;
     if (m_cb)
         m_cb->gotEvent(this);
-    if (m_task) {
-        Printer::elog(E_EVENT, "Signaling task %p (%s - %s)", m_task, m_task->getName(), ClassName(m_task).c_str());
-        m_task->getTaskMan()->signalTask(m_task);
+    if (t) {
+        Printer::elog(E_EVENT, "Signaling task %p (%s - %s)", t, t->getName(), ClassName(t).c_str());
+        t->getTaskMan()->signalTask(t);
     }
 }
 
+Balau::Events::BaseEvent::~BaseEvent() {
+    TaskMan * tm = m_postedTo.load();
+    if (tm)
+        tm->cancelSignal(this);
+    if (m_cb)
+        delete m_cb;
+}
+
+void Balau::Events::BaseEvent::postSignal() {
+    Task * t = m_task.load();
+    if (!t) {
+        Printer::elog(E_EVENT, "Event at %p (%s) posted without any task waiting for it; dropping.", this, ClassName(this).c_str());
+        return;
+    }
+    t->getTaskMan()->postSignal(this);
+}
+
 Balau::Events::TaskEvent::TaskEvent(Task * taskWaited) : m_taskWaited(NULL), m_ack(false), m_distant(false) {
     if (taskWaited)
         attachToTask(taskWaited);
@@ -301,30 +462,18 @@ void Balau::Events::TaskEvent::attachToTask(Task * taskWaited) {
 
 void Balau::Events::TaskEvent::signal() {
     if (m_distant)
-        m_evt.send();
+        postSignal();
     else
         doSignal();
 }
 
 void Balau::Events::TaskEvent::gotOwner(Task * task) {
-    TaskMan * tm = task->getTaskMan();
-
-    m_evt.stop();
-    if (tm != m_taskWaited->getTaskMan()) {
-        m_evt.set(tm->getLoop());
-        m_evt.set<TaskEvent, &TaskEvent::evt_cb>(this);
-        m_evt.start();
-        m_distant = true;
-    } else {
-        m_distant = false;
-    }
+    m_distant = task->getTaskMan() != m_taskWaited->getTaskMan();
 }
 
 Balau::Events::TaskEvent::~TaskEvent() {
     if (!m_ack)
         ack();
-    if (m_distant)
-        m_evt.stop();
 }
 
 void Balau::Events::TaskEvent::ack() {
@@ -353,11 +502,6 @@ void Balau::Events::Timeout::gotOwner(Task * task) {
     m_evt.start();
 }
 
-void Balau::Events::Async::gotOwner(Task * task) {
-    m_evt.set(task->getLoop());
-    m_evt.start();
-}
-
 void Balau::Events::Custom::gotOwner(Task * task) {
     m_loop = task->getLoop();
 }
@@ -401,43 +545,84 @@ void Balau::Task::operationYield(Events::BaseEvent * evt, enum OperationYieldTyp
     }
 }
 
-void Balau::QueueBase::iPush(void * t, Events::Async * event) {
-    ScopeLock sl(m_lock);
-    Cell * c = new Cell(t);
-    c->m_prev = m_back;
-    if (m_back)
-        m_back->m_next = c;
-    else
-        m_front = c;
-    m_back = c;
-    if (event)
+void Balau::QueueBase::link(QueueNode * node) {
+    node->m_queueNext.store(NULL, std::memory_order_relaxed);
+    QueueNode * prev = m_head.exchange(node, std::memory_order_acq_rel);
+    // between the exchange and that store, the consumer can't see past prev; see unlink()
+    prev->m_queueNext.store(node, std::memory_order_release);
+}
+
+// only called with m_lock held
+Balau::QueueNode * Balau::QueueBase::unlink() {
+    QueueNode * tail = m_tail;
+    QueueNode * next = tail->m_queueNext.load(std::memory_order_acquire);
+    if (tail == &m_stub) {
+        if (!next)
+            return NULL;
+        m_tail = tail = next;
+        next = next->m_queueNext.load(std::memory_order_acquire);
+    }
+    if (next) {
+        m_tail = next;
+        return tail;
+    }
+    if (tail != m_head.load(std::memory_order_acquire))
+        return NULL;
+    link(&m_stub);
+    next = tail->m_queueNext.load(std::memory_order_acquire);
+    if (next) {
+        m_tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+bool Balau::QueueBase::iPush(QueueNode * node, Events::Async * event) {
+    // once linked, the node can be popped, and the queue destroyed, before we're done signalling; see waitForProducers()
+    m_pushing.fetch_add(1);
+    link(node);
+    bool wasEmpty = m_count.fetch_add(1) == 0;
+    if (event) {
         event->trigger();
-    else
+    } else if (m_waiters.load() != 0) {
+        // the waiting consumer holds the lock until it's in pthread_cond_wait, so we can't miss it.
+        ScopeLock sl(m_lock);
         pthread_cond_signal(&m_cond);
+    }
+    // last access to the queue
+    m_pushing.fetch_sub(1);
+    return wasEmpty;
+}
+
+void Balau::QueueBase::waitForProducers() {
+    while (m_pushing.load() != 0)
+        sched_yield();
 }
 
-void * Balau::QueueBase::iPop(Events::Async * event, bool wait) {
+Balau::QueueNode * Balau::QueueBase::iPop(Events::Async * event, bool wait) {
     ScopeLock sl(m_lock);
-    while (!m_front && wait) {
+    while ((m_count.load() == 0) && wait) {
         if (event) {
             Task::prepare(event);
-            m_lock.leave();
-            Task::operationYield(event, Task::INTERRUPTIBLE);
-            m_lock.enter();
+            if (m_count.load() == 0) {
+                m_lock.leave();
+                Task::operationYield(event, Task::INTERRUPTIBLE);
+                m_lock.enter();
+            }
             event->resetMaybe();
         } else {
-            pthread_cond_wait(&m_cond, &m_lock.m_lock);
+            ++m_waiters;
+            if (m_count.load() == 0)
+                pthread_cond_wait(&m_cond, &m_lock.m_lock);
+            --m_waiters;
         }
     }
-    Cell * c = m_front;
-    if (!c)
+    if (m_count.load() == 0)
         return NULL;
-    m_front = c->m_next;
-    if (m_front)
-        m_front->m_prev = NULL;
-    else
-        m_back = NULL;
-    void * t = c->m_elem;
-    delete c;
-    return t;
+    QueueNode * node;
+    // the count says there's something; a producer may just not have finished linking it yet.
+    while (!(node = unlink()))
+        sched_yield();
+    --m_count;
+    return node;
 }
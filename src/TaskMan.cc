@@ -4,13 +4,18 @@
 #include "Main.h"
 #include "Local.h"
 #include "CurlTask.h"
+#include "IoUring.h"
 
 #include <ares.h>
 #include <curl/curl.h>
+#include <algorithm>
 
 #ifdef _WIN32
 #include <windows.h>
 #include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
 #endif
 
 #undef ERROR
@@ -37,6 +42,7 @@ class Stopper : public Balau::Task {
   private:
     virtual void Do();
     virtual const char * getName() const;
+    virtual size_t stackSize() const { return 16 * 1024; }
     int m_code;
 };
 
@@ -111,100 +117,156 @@ const char * Stopper::getName() const {
 static Balau::DefaultTmpl<Balau::TaskMan> defaultTaskMan(50);
 static Balau::LocalTmpl<Balau::TaskMan> localTaskMan;
 
+// per stack size, we never keep more than TOO_MANY_STACKS stacks around, and
+// only the last HOT_STACKS of them stay resident; the others get trimmed.
 static const int TOO_MANY_STACKS = 1024;
+static const int HOT_STACKS = 32;
+
+// when a task registers another one, we keep it on the same TaskMan unless
+// that TaskMan has that many more tasks than the least loaded one.
+static const int LOCAL_LOAD_SLACK = 8;
+
+static std::atomic<bool> s_taskStatsEnabled(false);
+static std::atomic<uint64_t> s_steals(0), s_stolenTasks(0);
 
 namespace Balau {
 
-class TaskScheduler : public GlobalThread {
+class TaskScheduler {
   public:
-      TaskScheduler() : GlobalThread(100), m_stopping(false) { }
+      TaskScheduler() { }
     void registerTask(Task * t);
-    virtual void * proc();
-    virtual void threadExit();
     void registerTaskMan(TaskMan * t);
     void unregisterTaskMan(TaskMan * t);
     void stopAll(int code);
+    bool steal(TaskMan * thief);
+    void collectTaskStats(std::map<std::type_index, TaskMan::TaskStats> & stats);
   private:
-    Queue<Task> m_queue;
-    std::queue<TaskMan *> m_taskManagers;
-    Lock m_lock;
-    volatile bool m_stopping;
+    TaskMan * pickTaskMan();
+    void wakeIdle(TaskMan * except);
+    std::vector<TaskMan *> m_taskManagers;
+    std::queue<Task *> m_orphans;
+    Lock m_orphansLock;
+    RWLock m_lock;
 };
 
 };
 
 static Balau::TaskScheduler s_scheduler;
 
+Balau::TaskMan * Balau::TaskScheduler::pickTaskMan() {
+    Task * current = Task::getCurrentTask();
+    TaskMan * local = current ? current->getTaskMan() : NULL;
+    TaskMan * best = NULL;
+    int bestLoad = 0;
+
+    for (TaskMan * tm : m_taskManagers) {
+        int load = tm->getLoad();
+        if (!best || (load < bestLoad)) {
+            best = tm;
+            bestLoad = load;
+        }
+    }
+
+    if (local && (local->getLoad() <= (bestLoad + LOCAL_LOAD_SLACK)))
+        return local;
+
+    return best;
+}
+
+void Balau::TaskScheduler::wakeIdle(TaskMan * except) {
+    for (TaskMan * tm : m_taskManagers) {
+        if ((tm != except) && tm->m_idle.load()) {
+            tm->m_evt.send();
+            return;
+        }
+    }
+}
+
 void Balau::TaskScheduler::registerTask(Task * t) {
     Printer::elog(E_TASK, "TaskScheduler::registerTask with t = %p", t);
-    m_queue.push(t);
+    ScopeLockR sl(m_lock);
+    TaskMan * tm = pickTaskMan();
+    if (!tm) {
+        Printer::elog(E_TASK, "TaskScheduler has no TaskMan yet; keeping task %p aside", t);
+        ScopeLock slOrphans(m_orphansLock);
+        m_orphans.push(t);
+        return;
+    }
+    Printer::elog(E_TASK, "TaskScheduler adding task %s at %p to TaskMan %p", t->getName(), t, tm);
+    tm->pushStarting(t);
+    Task * current = Task::getCurrentTask();
+    if (!current || (current->getTaskMan() != tm))
+        tm->m_evt.send();
+    else if (tm->startingSize() > 1)
+        wakeIdle(tm);
 }
 
 void Balau::TaskScheduler::registerTaskMan(TaskMan * t) {
-    ScopeLock sl(m_lock);
-    m_taskManagers.push(t);
+    ScopeLockW sl(m_lock);
+    m_taskManagers.push_back(t);
+    ScopeLock slOrphans(m_orphansLock);
+    while (!m_orphans.empty()) {
+        t->pushStarting(m_orphans.front());
+        m_orphans.pop();
+    }
 }
 
 void Balau::TaskScheduler::unregisterTaskMan(TaskMan * t) {
-    ScopeLock sl(m_lock);
-    TaskMan * p = NULL;
-    // yes, this is a potentially dangerous operation.
-    // But unregistering task managers shouldn't happen that often.
-    while (true) {
-        p = m_taskManagers.front();
-        m_taskManagers.pop();
-        if (p == t)
+    ScopeLockW sl(m_lock);
+    for (auto i = m_taskManagers.begin(); i != m_taskManagers.end(); i++) {
+        if (*i == t) {
+            m_taskManagers.erase(i);
             break;
-        m_taskManagers.push(p);
+        }
+    }
+    // hand over the tasks that never got a chance to start
+    ScopeLock slStarting(t->m_startingLock);
+    while (!t->m_starting.empty()) {
+        Task * task = t->m_starting.front();
+        t->m_starting.pop_front();
+        --t->m_load;
+        TaskMan * tm = pickTaskMan();
+        if (tm) {
+            tm->pushStarting(task);
+            tm->m_evt.send();
+        } else {
+            ScopeLock slOrphans(m_orphansLock);
+            m_orphans.push(task);
+        }
     }
 }
 
 void Balau::TaskScheduler::stopAll(int code) {
-    m_stopping = true;
-    ScopeLock sl(m_lock);
-    std::queue<TaskMan *> altQueue;
-    TaskMan * tm;
-    while (!m_taskManagers.empty()) {
-        tm = m_taskManagers.front();
-        m_taskManagers.pop();
-        altQueue.push(tm);
+    ScopeLockR sl(m_lock);
+    for (TaskMan * tm : m_taskManagers)
         tm->addToPending(new Stopper(code));
-    }
-    while (!altQueue.empty()) {
-        tm = altQueue.front();
-        altQueue.pop();
-        m_taskManagers.push(tm);
-    }
 }
 
-void * Balau::TaskScheduler::proc() {
-    while (true) {
-        Printer::elog(E_TASK, "TaskScheduler waiting for a task to pop");
-        Task * t = m_queue.pop();
-        if (!t)
-            break;
-        if (dynamic_cast<Stopper *>(t) || m_stopping)
-            break;
-        m_lock.enter();
-        size_t s = m_taskManagers.size();
-        if (s == 0)
-            break;
-        TaskMan * tm = m_taskManagers.front();
-        if (s != 1) {
-            m_taskManagers.pop();
-            m_taskManagers.push(tm);
+void Balau::TaskScheduler::collectTaskStats(std::map<std::type_index, TaskMan::TaskStats> & stats) {
+    ScopeLockR sl(m_lock);
+    for (TaskMan * tm : m_taskManagers)
+        tm->collectTaskStats(stats);
+}
+
+bool Balau::TaskScheduler::steal(TaskMan * thief) {
+    ScopeLockR sl(m_lock);
+    TaskMan * victim = NULL;
+    size_t victimSize = 0;
+
+    for (TaskMan * tm : m_taskManagers) {
+        if (tm == thief)
+            continue;
+        size_t s = tm->startingSize();
+        if (s > victimSize) {
+            victim = tm;
+            victimSize = s;
         }
-        m_lock.leave();
-        Printer::elog(E_TASK, "TaskScheduler popped task %s at %p; adding to TaskMan %p", t->getName(), t, tm);
-        tm->addToPending(t);
     }
-    Printer::elog(E_TASK, "TaskScheduler stopping.");
-    return NULL;
-}
 
-void Balau::TaskScheduler::threadExit() {
-    Task * s = NULL;
-    m_queue.push(s);
+    if (!victim)
+        return false;
+
+    return thief->stealFrom(victim) != 0;
 }
 
 void asyncDummy(ev::async & w, int revents) {
@@ -236,9 +298,10 @@ Balau::TaskMan::TaskMan() {
     m_evt.set(m_loop);
     m_evt.set<asyncDummy>();
     m_evt.start();
-    s_scheduler.registerTaskMan(this);
+    m_timerWheel = new TimerWheel(m_loop);
 
-    m_nStacks = 0;
+    m_load = 0;
+    m_idle = false;
 
     m_curlMulti = curl_multi_init();
 
@@ -265,6 +328,8 @@ Balau::TaskMan::TaskMan() {
         m_aresSockets[i] = ARES_SOCKET_BAD;
         m_aresSocketEvents[i] = NULL;
     }
+
+    s_scheduler.registerTaskMan(this);
 }
 
 #ifdef _WIN32
@@ -456,12 +521,21 @@ static WinSocketStartup wsa;
 
 Balau::TaskMan * Balau::TaskMan::getDefaultTaskMan() { return localTaskMan.get(); }
 
+#ifndef _WIN32
+static size_t getPageSize() {
+    static size_t pageSize = sysconf(_SC_PAGESIZE);
+    return pageSize;
+}
+#endif
+
 Balau::TaskMan::~TaskMan() {
     AAssert(localTaskMan.getGlobal() != this, "Don't create / delete a TaskMan directly");
-    while (m_stacks.size() != 0) {
-        free(m_stacks.front());
-        m_stacks.pop();
-    }
+#ifndef _WIN32
+    for (auto & i : m_stacks)
+        for (void * stack : i.second.stacks)
+            munmap((uint8_t *) stack - getPageSize(), i.first + getPageSize());
+#endif
+    m_stacks.clear();
     s_scheduler.unregisterTaskMan(this);
     // probably way more work to do here in order to clean up tasks from that thread
     m_evt.stop();
@@ -485,42 +559,110 @@ Balau::TaskMan::~TaskMan() {
         m_aresSocketEvents[1]->stop();
     m_aresSocketEvents[1] = NULL;
 
+    delete m_timerWheel;
+#ifdef HAVE_IO_URING
+    delete m_ioUring;
+#endif
     ev_loop_destroy(m_loop);
 }
 
-void * Balau::TaskMan::getStack() {
+void Balau::TaskMan::setupTask(Task * t) {
+    ev_now_update(m_loop);
+    if (t->isStackless()) {
+        t->setup(this, NULL);
+        if (s_taskStatsEnabled.load(std::memory_order_relaxed))
+            t->m_readySince = ev_time();
+        return;
+    }
+    size_t size = t->stackSize();
+#ifndef _WIN32
+    size_t pageSize = getPageSize();
+    size = (size + pageSize - 1) & ~(pageSize - 1);
+#endif
+    t->m_stackSize = size;
+    t->setup(this, getStack(size));
+    if (s_taskStatsEnabled.load(std::memory_order_relaxed))
+        t->m_readySince = ev_time();
+}
+
+// stacks are mmaped with one extra PROT_NONE page at the bottom, so that an overflow faults instead of silently corrupting memory.
+void * Balau::TaskMan::getStack(size_t size) {
     if (!Task::needsStacks())
         return NULL;
-    void * r = NULL;
-    if (m_nStacks == 0) {
-        r = malloc(Task::stackSize());
-    } else {
-        r = m_stacks.front();
-        m_stacks.pop();
-        m_nStacks--;
+#ifndef _WIN32
+    size_t pageSize = getPageSize();
+    {
+        ScopeLock sl(m_stacksLock);
+        StackBucket & bucket = m_stacks[size];
+        bucket.inUse++;
+        if (!bucket.stacks.empty()) {
+            void * r = bucket.stacks.back();
+            bucket.stacks.pop_back();
+            return r;
+        }
     }
-    return r;
+    uint8_t * map = (uint8_t *) mmap(NULL, size + pageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+    RAssert(map != MAP_FAILED, "Unable to allocate a stack of %zu bytes: errno = %i", size, errno);
+    int r = mprotect(map, pageSize, PROT_NONE);
+    RAssert(r == 0, "Unable to set up the guard page of a stack: errno = %i", errno);
+    Printer::elog(E_TASK, "TaskMan at %p mapped a new stack of %zu bytes at %p", this, size, map + pageSize);
+    return map + pageSize;
+#else
+    return NULL;
+#endif
 }
 
-void Balau::TaskMan::freeStack(void * stack) {
+void Balau::TaskMan::freeStack(void * stack, size_t size) {
     if (!stack)
         return;
-    if (m_nStacks >= TOO_MANY_STACKS) {
-        free(stack);
-    } else {
-        m_stacks.push(stack);
-        m_nStacks++;
+#ifndef _WIN32
+    size_t pageSize = getPageSize();
+    bool unmap = false;
+    bool trim = false;
+    {
+        ScopeLock sl(m_stacksLock);
+        StackBucket & bucket = m_stacks[size];
+        if (bucket.inUse > 0)
+            bucket.inUse--;
+        int n = bucket.stacks.size();
+        if (n >= TOO_MANY_STACKS) {
+            unmap = true;
+        } else {
+            trim = n >= HOT_STACKS;
+            bucket.stacks.push_back(stack);
+        }
+    }
+    if (unmap) {
+        munmap((uint8_t *) stack - pageSize, size + pageSize);
+    } else if (trim) {
+        // the pages are given back to the kernel, but the mapping stays valid and will be faulted back in as zeroes.
+        int r = -1;
+#ifdef MADV_FREE
+        r = madvise(stack, size, MADV_FREE);
+#endif
+        // older kernels don't know about MADV_FREE
+        if (r != 0)
+            madvise(stack, size, MADV_DONTNEED);
     }
+#endif
 }
 
-int Balau::TaskMan::mainLoop() {
-    taskHash_t starting, stopped, yielded, yielded2;
-    taskHash_t::iterator iH;
+std::vector<Balau::TaskMan::StackPoolStats> Balau::TaskMan::getStackPoolStats() {
+    std::vector<StackPoolStats> r;
+    ScopeLock sl(m_stacksLock);
+    for (auto & i : m_stacks) {
+        StackPoolStats stats;
+        stats.stackSize = i.first;
+        stats.inUse = i.second.inUse;
+        stats.pooled = i.second.stacks.size();
+        stats.resident = std::min(stats.pooled, HOT_STACKS);
+        r.push_back(stats);
+    }
+    return r;
+}
 
-    // we start by pushing all of the 'STARTING' tasks into the appropriate queue.
-    for (Task * t : m_tasks)
-        if (t->getStatus() == Task::STARTING)
-            starting.insert(t);
+int Balau::TaskMan::mainLoop() {
+    Task * t;
 
     s_async.setIdleReadyCallback(asyncIdleReady, this);
 
@@ -528,20 +670,22 @@ int Balau::TaskMan::mainLoop() {
         Printer::elog(E_TASK, "TaskMan::mainLoop() at %p with m_tasks.size = %li", this, m_tasks.size());
 
         // checking "STARTING" tasks, and running them once
-        while ((iH = starting.begin()) != starting.end()) {
-            Task * t = *iH;
+        while ((t = m_startingTasks.popFront())) {
             IAssert(t->getStatus() == Task::STARTING, "Got task at %p in the starting list, but isn't starting.", t);
-            t->switchTo();
+            runTask(t);
             IAssert(t->getStatus() != Task::STARTING, "Task at %p got switchedTo, but still is 'STARTING'.", t);
-            starting.erase(iH);
             if ((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED))
-                stopped.insert(t);
+                m_stoppedTasks.pushBack(t);
             if (t->getStatus() == Task::YIELDED)
-                yielded.insert(t);
+                enqueue(m_yieldedTasks, t);
         }
 
         // if we begin that loop with any pending task, just don't block, so we can add them immediately.
-        bool noWait = !m_pendingAdd.isEmpty() || !yielded.empty() || !stopped.empty();
+        bool noWait = !m_pendingAdd.isEmpty() || (startingSize() != 0) || hasYieldedTasks() || !m_stoppedTasks.empty();
+
+        // nothing to do on our side; let's see if another TaskMan has a backlog we can take over.
+        if (!noWait && m_signaledTasks[Task::PRIORITY_HIGH].empty() && m_signaledTasks[Task::PRIORITY_NORMAL].empty() && m_signaledTasks[Task::PRIORITY_LOW].empty() && !m_stopped)
+            noWait = s_scheduler.steal(this);
         bool curlNeedsSpin = (!m_curlTimer.is_active() && m_curlStillRunning != 0) || m_curlGotNewHandles;
 
         // Process c-ares requests
@@ -556,9 +700,18 @@ int Balau::TaskMan::mainLoop() {
             delete request;
         }
 
+#ifdef HAVE_IO_URING
+        // hand all the file operations our tasks queued in the ring to the kernel at once.
+        if (m_ioUring && !m_ioUring->submit())
+            noWait = true;
+#endif
+
         // libev's event "loop". We always runs it once though.
         Printer::elog(E_TASK, "TaskMan at %p Going to libev main loop; stopped = %s", this, m_stopped ? "true" : "false");
-        ev_run(m_loop, noWait || curlNeedsSpin || m_stopped ? EVRUN_NOWAIT : EVRUN_ONCE);
+        bool block = !(noWait || curlNeedsSpin || m_stopped);
+        m_idle = block;
+        ev_run(m_loop, block ? EVRUN_ONCE : EVRUN_NOWAIT);
+        m_idle = false;
         Printer::elog(E_TASK, "TaskMan at %p Getting out of libev main loop", this);
 
         // calling async's idle
@@ -583,8 +736,11 @@ int Balau::TaskMan::mainLoop() {
             curlTask->curlDone(curlMsg->data.result);
         }
 
+        // signals that came from other threads
+        drainInbox();
+
         // let's check what task got stopped, and signal them
-        for (Task * t : stopped) {
+        for (t = m_stoppedTasks.front(); t; t = runList_t::next(t)) {
             IAssert((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED), "Task %p in stopped list but isn't stopped.", t);
             if (t->m_waitedBy.size() != 0)
                 for (Events::TaskEvent * e : t->m_waitedBy)
@@ -592,78 +748,84 @@ int Balau::TaskMan::mainLoop() {
         }
         m_allowedToSignal = false;
 
-        // let's check who got signaled, and call them
-        for (Task * t : m_signaledTasks) {
-            Printer::elog(E_TASK, "TaskMan at %p Switching to task %p (%s - %s) that got signaled somehow.", this, t, t->getName(), ClassName(t).c_str());
-            IAssert(t->getStatus() == Task::SLEEPING || t->getStatus() == Task::YIELDED, "We're switching to a non-sleeping/yielded task at %p... ? status = %i", t, t->getStatus());
-            bool toRemoveFromYielded = t->getStatus() == Task::YIELDED;
-            t->switchTo();
-            if ((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED)) {
-                stopped.insert(t);
-            } else if (t->getStatus() == Task::YIELDED) {
-                taskHash_t::iterator i = yielded.find(t);
-                if (i == yielded.end())
-                    yielded.insert(t);
-                toRemoveFromYielded = false;
-            }
-            if (toRemoveFromYielded) {
-                taskHash_t::iterator i = yielded.find(t);
-                IAssert(i != yielded.end(), "Task %s of type %s at %p was yielded, but not in yielded list... ?", t->getName(), ClassName(t).c_str(), t);
-                yielded.erase(i);
+        // let's check who got signaled, and call them, highest priority first
+        bool ranUrgentTasks = false;
+        for (int p = 0; p < Task::PRIORITY_COUNT; p++) {
+            while ((t = m_signaledTasks[p].popFront())) {
+                Printer::elog(E_TASK, "TaskMan at %p Switching to task %p (%s - %s) that got signaled somehow.", this, t, t->getName(), ClassName(t).c_str());
+                IAssert(t->getStatus() == Task::SLEEPING || t->getStatus() == Task::YIELDED, "We're switching to a non-sleeping/yielded task at %p... ? status = %i", t, t->getStatus());
+                if (p != Task::PRIORITY_LOW)
+                    ranUrgentTasks = true;
+                runTask(t);
+                if ((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED))
+                    m_stoppedTasks.pushBack(t);
+                else if (t->getStatus() == Task::YIELDED)
+                    enqueue(m_yieldedTasks, t);
             }
         }
-        m_signaledTasks.clear();
-
-        // now let's make a round of yielded tasks
-        for (Task * t : yielded) {
-            Printer::elog(E_TASK, "TaskMan at %p Switching to task %p (%s - %s) that was yielded.", this, t, t->getName(), ClassName(t).c_str());
-            IAssert(t->getStatus() == Task::YIELDED, "Task %s of type %s at %p was in yielded list, but wasn't yielded ?", t->getName(), ClassName(t).c_str(), t);
-            t->switchTo();
-            if ((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED)) {
-                stopped.insert(t);
-            } else if (t->getStatus() == Task::YIELDED) {
-                yielded2.insert(t);
+
+        // now let's make a round of yielded tasks; the ones yielding again go back for the next round.
+        // Low priority ones only get their round when nothing more urgent ran, or when they waited long enough.
+        ev_tstamp now = ev_now(m_loop);
+        for (int p = 0; p < Task::PRIORITY_COUNT; p++) {
+            if (p == Task::PRIORITY_LOW) {
+                if (m_yieldedTasks[p].empty() || (ranUrgentTasks && ((now - m_lowPriorityLastRun) < m_maxStarvation)))
+                    break;
+                m_lowPriorityLastRun = now;
+            }
+            runList_t yielded;
+            yielded.splice(m_yieldedTasks[p]);
+            if (!yielded.empty() && (p != Task::PRIORITY_LOW))
+                ranUrgentTasks = true;
+            while ((t = yielded.popFront())) {
+                Printer::elog(E_TASK, "TaskMan at %p Switching to task %p (%s - %s) that was yielded.", this, t, t->getName(), ClassName(t).c_str());
+                IAssert(t->getStatus() == Task::YIELDED, "Task %s of type %s at %p was in yielded list, but wasn't yielded ?", t->getName(), ClassName(t).c_str(), t);
+                runTask(t);
+                if ((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED))
+                    m_stoppedTasks.pushBack(t);
+                else if (t->getStatus() == Task::YIELDED)
+                    enqueue(m_yieldedTasks, t);
             }
         }
-        yielded = yielded2;
-        yielded2.clear();
 
         // Adding tasks that were added, maybe from other threads
         while (!m_pendingAdd.isEmpty()) {
             Printer::elog(E_TASK, "TaskMan at %p trying to pop a task...", this);
-            Task * t = m_pendingAdd.pop();
+            t = m_pendingAdd.pop();
             Printer::elog(E_TASK, "TaskMan at %p popped task %s of type %s at %p...", this, t->getName(), ClassName(t).c_str(), t);
-            IAssert(m_tasks.find(t) == m_tasks.end(), "TaskMan got task %p twice... ?", t);
-            ev_now_update(m_loop);
-            t->setup(this, t->isStackless() ? NULL : getStack());
-            m_tasks.insert(t);
-            starting.insert(t);
+            IAssert(!allList_t::linked(t), "TaskMan got task %p twice... ?", t);
+            setupTask(t);
+            m_tasks.pushBack(t);
+            m_startingTasks.pushBack(t);
         }
 
-        // Finally, let's destroy tasks that no longer are necessary.
-        bool didDelete;
-        do {
-            didDelete = false;
-            for (auto iH = stopped.begin(); iH != stopped.end(); iH++) {
-                Task * t = *iH;
-                IAssert((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED), "Task %p in stopped list but isn't stopped.", t);
-                t->m_eventLock.enter();
-                if (t->m_waitedBy.size() == 0) {
-                    freeStack(t->m_stack);
-                    stopped.erase(iH);
-                    iH = m_tasks.find(t);
-                    IAssert(iH != m_tasks.end(), "Task %s of type %s at %p in stopped list but not in m_tasks...", t->getName(), ClassName(t).c_str(), t);
-                    m_tasks.erase(iH);
-                    IAssert(yielded.find(t) == yielded.end(), "Task %s of type %s at %p is deleted but is in yielded list... ?", t->getName(), ClassName(t).c_str(), t);
-                    t->m_eventLock.leave();
-                    delete t;
-                    didDelete = true;
-                    break;
-                }
-                if (!didDelete)
-                    t->m_eventLock.leave();
+        // and the ones that got scheduled on us, or that we stole
+        while ((t = popStarting())) {
+            Printer::elog(E_TASK, "TaskMan at %p starting task %s of type %s at %p...", this, t->getName(), ClassName(t).c_str(), t);
+            IAssert(!allList_t::linked(t), "TaskMan got task %p twice... ?", t);
+            setupTask(t);
+            m_tasks.pushBack(t);
+            m_startingTasks.pushBack(t);
+        }
+
+        // Finally, let's destroy tasks that no longer are necessary, in a single pass.
+        Task * next;
+        for (t = m_stoppedTasks.front(); t; t = next) {
+            next = runList_t::next(t);
+            IAssert((t->getStatus() == Task::STOPPED) || (t->getStatus() == Task::FAULTED), "Task %p in stopped list but isn't stopped.", t);
+            t->m_eventLock.enter();
+            if (t->m_waitedBy.size() != 0) {
+                t->m_eventLock.leave();
+                continue;
             }
-        } while (didDelete);
+            freeStack(t->m_stack, t->m_stackSize);
+            m_stoppedTasks.remove(t);
+            IAssert(m_tasks.contains(t), "Task %s of type %s at %p in stopped list but not in m_tasks...", t->getName(), ClassName(t).c_str(), t);
+            m_tasks.remove(t);
+            t->m_eventLock.leave();
+            delete t;
+            --m_load;
+        }
 
     } while (!m_stopped);
     Printer::elog(E_TASK, "TaskManager at %p stopping.", this);
@@ -704,11 +866,15 @@ void Balau::TaskMan::aresHostCallback(void * arg, int status, int timeouts, stru
     delete callback;
 }
 
-void Balau::TaskMan::iRegisterTask(Balau::Task * t, Balau::Task * stick, Events::TaskEvent * event) {
+void Balau::TaskMan::iRegisterTask(Balau::Task * t, Balau::Task * stick, Events::TaskEvent * event, TaskMan * taskMan) {
     if (stick) {
-        IAssert(!event, "inconsistent");
+        IAssert(!event && !taskMan, "inconsistent");
         TaskMan * tm = stick->getTaskMan();
         tm->addToPending(t);
+    } else if (taskMan) {
+        if (event)
+            event->attachToTask(t);
+        taskMan->addToPending(t);
     } else {
         if (event)
             event->attachToTask(t);
@@ -720,26 +886,333 @@ void Balau::TaskMan::registerAsyncOp(Balau::AsyncOperation * op) {
     s_async.queueOp(op);
 }
 
+Balau::IoUring * Balau::TaskMan::getIoUring() {
+#ifdef HAVE_IO_URING
+    if (!m_useIoUring)
+        return NULL;
+    if (!m_ioUringProbed) {
+        m_ioUringProbed = true;
+        m_ioUring = IoUring::create(m_loop);
+    }
+#endif
+    return m_ioUring;
+}
+
+void Balau::TaskMan::setAsyncWorkers(int n) {
+    s_async.setMainWorkers(n);
+}
+
+void Balau::TaskMan::setAsyncFinishers(int minIdle, int maxIdle) {
+    s_async.setFinishers(minIdle, maxIdle);
+}
+
+void Balau::TaskMan::setAsyncFinishersTarget(int maxFinishers, ev_tstamp targetWait) {
+    s_async.setFinishersTarget(maxFinishers, targetWait);
+}
+
+Balau::AsyncFinisherStats Balau::TaskMan::getAsyncFinisherStats() {
+    return s_async.getFinisherStats();
+}
+
+std::vector<Balau::AsyncStats> Balau::TaskMan::getAsyncStats() {
+    return s_async.getStats();
+}
+
 void Balau::TaskMan::addToPending(Balau::Task * t) {
-    m_pendingAdd.push(t);
-    m_evt.send();
+    ++m_load;
+    // only the first task of a batch needs to wake us up; we always drain the whole queue.
+    if (m_pendingAdd.push(t))
+        m_evt.send();
+}
+
+void Balau::TaskMan::postSignal(Events::BaseEvent * e) {
+    bool wasEmpty;
+    {
+        ScopeLock sl(m_inboxLock);
+        if (e->m_postedTo.load() == this)
+            return;
+        e->m_postedTo = this;
+        wasEmpty = m_inbox.empty();
+        m_inbox.push_back(e);
+    }
+    if (wasEmpty)
+        m_evt.send();
+}
+
+void Balau::TaskMan::cancelSignal(Events::BaseEvent * e) {
+    ScopeLock sl(m_inboxLock);
+    if (e->m_postedTo.load() != this)
+        return;
+    e->m_postedTo = NULL;
+    for (auto i = m_inbox.begin(); i != m_inbox.end(); i++) {
+        if (*i == e) {
+            m_inbox.erase(i);
+            return;
+        }
+    }
+    // drainInbox() is going through it right now; just leave a hole.
+    for (auto & d : m_inboxDraining) {
+        if (d == e) {
+            d = NULL;
+            return;
+        }
+    }
+}
+
+void Balau::TaskMan::drainInbox() {
+    size_t n;
+    {
+        ScopeLock sl(m_inboxLock);
+        if (m_inbox.empty())
+            return;
+        m_inbox.swap(m_inboxDraining);
+        n = m_inboxDraining.size();
+    }
+    Printer::elog(E_TASK, "TaskMan at %p signaling %zu events posted from other threads", this, n);
+    // each event stays posted until its turn comes, since a callback may delete the ones that came along with it.
+    for (size_t i = 0; i < n; i++) {
+        Events::BaseEvent * e;
+        {
+            ScopeLock sl(m_inboxLock);
+            e = m_inboxDraining[i];
+            m_inboxDraining[i] = NULL;
+            if (e)
+                e->m_postedTo = NULL;
+        }
+        if (e)
+            e->doSignal();
+    }
+    ScopeLock sl(m_inboxLock);
+    m_inboxDraining.clear();
+}
+
+void Balau::TaskMan::pushStarting(Balau::Task * t) {
+    ScopeLock sl(m_startingLock);
+    ++m_load;
+    m_starting.push_back(t);
+}
+
+Balau::Task * Balau::TaskMan::popStarting() {
+    ScopeLock sl(m_startingLock);
+    if (m_starting.empty())
+        return NULL;
+    Task * t = m_starting.front();
+    m_starting.pop_front();
+    return t;
+}
+
+int Balau::TaskMan::stealFrom(TaskMan * victim) {
+    std::deque<Task *> stolen;
+
+    {
+        ScopeLock sl(victim->m_startingLock);
+        size_t n = (victim->m_starting.size() + 1) / 2;
+        while (n--) {
+            stolen.push_front(victim->m_starting.back());
+            victim->m_starting.pop_back();
+            --victim->m_load;
+        }
+    }
+
+    int r = stolen.size();
+    Printer::elog(E_TASK, "TaskMan at %p stole %i tasks from TaskMan at %p", this, r, victim);
+    if (r) {
+        ++s_steals;
+        s_stolenTasks += r;
+    }
+
+    ScopeLock sl(m_startingLock);
+    for (Task * t : stolen) {
+        ++m_load;
+        m_starting.push_back(t);
+    }
+
+    return r;
 }
 
 void Balau::TaskMan::signalTask(Task * t) {
-    AAssert(m_tasks.find(t) != m_tasks.end(), "Can't signal task %s of type %s at %p that I don't own (me = %p)", t->getName(), ClassName(t).c_str(), t, this);
+    AAssert(t->m_taskMan == this, "Can't signal task %s of type %s at %p that I don't own (me = %p)", t->getName(), ClassName(t).c_str(), t, this);
     AAssert(m_allowedToSignal, "I'm not allowed to signal (me = %p)", this);
-    m_signaledTasks.insert(t);
+    for (int p = 0; p < Task::PRIORITY_COUNT; p++) {
+        if (m_signaledTasks[p].contains(t))
+            return;
+        if (m_yieldedTasks[p].contains(t))
+            m_yieldedTasks[p].remove(t);
+    }
+    IAssert(!runList_t::linked(t), "Signaled task %s of type %s at %p is neither sleeping nor yielded... ?", t->getName(), ClassName(t).c_str(), t);
+    enqueue(m_signaledTasks, t);
+}
+
+void Balau::TaskMan::enqueue(runList_t * lists, Task * t) {
+    if (s_taskStatsEnabled.load(std::memory_order_relaxed))
+        t->m_readySince = ev_time();
+    runList_t & list = lists[t->getPriority()];
+    ev_tstamp deadline = t->getDeadline();
+    if (deadline == 0) {
+        list.pushBack(t);
+        return;
+    }
+    // tasks with a deadline go first, sorted; tasks without one keep their FIFO order after them.
+    Task * pos;
+    for (pos = list.front(); pos; pos = runList_t::next(pos)) {
+        ev_tstamp d = pos->getDeadline();
+        if ((d == 0) || (d > deadline))
+            break;
+    }
+    list.insertBefore(pos, t);
+}
+
+void Balau::TaskMan::runTask(Task * t) {
+    if (!s_taskStatsEnabled.load(std::memory_order_relaxed)) {
+        t->switchTo();
+        return;
+    }
+
+    ev_tstamp start = ev_time();
+    ev_tstamp readySince = t->m_readySince;
+    t->m_readySince = 0;
+    t->switchTo();
+    ev_tstamp end = ev_time();
+
+    int bucket = 0;
+    if (readySince != 0) {
+        uint64_t us = (start - readySince) * 1000000;
+        while (us && (bucket < (LATENCY_BUCKETS - 1))) {
+            us >>= 1;
+            bucket++;
+        }
+    }
+
+    ScopeLock sl(m_taskStatsLock);
+    auto i = m_taskStats.find(std::type_index(typeid(*t)));
+    if (i == m_taskStats.end()) {
+        i = m_taskStats.insert(std::make_pair(std::type_index(typeid(*t)), TaskStats())).first;
+        i->second.className = ClassName(t).c_str();
+    }
+    TaskStats & stats = i->second;
+    stats.switches++;
+    stats.runTime += end - start;
+    if (readySince != 0)
+        stats.latencies[bucket]++;
+}
+
+void Balau::TaskMan::collectTaskStats(std::map<std::type_index, TaskStats> & stats) {
+    ScopeLock sl(m_taskStatsLock);
+    for (auto & i : m_taskStats) {
+        auto j = stats.find(i.first);
+        if (j == stats.end()) {
+            stats.insert(i);
+            continue;
+        }
+        j->second.switches += i.second.switches;
+        j->second.runTime += i.second.runTime;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+            j->second.latencies[b] += i.second.latencies[b];
+    }
+}
+
+void Balau::TaskMan::enableTaskStats(bool enable) {
+    s_taskStatsEnabled = enable;
+}
+
+std::vector<Balau::TaskMan::TaskStats> Balau::TaskMan::getTaskStats() {
+    std::map<std::type_index, TaskStats> stats;
+    s_scheduler.collectTaskStats(stats);
+    std::vector<TaskStats> r;
+    for (auto & i : stats)
+        r.push_back(i.second);
+    return r;
+}
+
+Balau::TaskMan::SchedulerStats Balau::TaskMan::getSchedulerStats() {
+    SchedulerStats r;
+    r.steals = s_steals.load();
+    r.stolenTasks = s_stolenTasks.load();
+    return r;
+}
+
+bool Balau::TaskMan::hasYieldedTasks() {
+    for (int p = 0; p < Task::PRIORITY_COUNT; p++)
+        if (!m_yieldedTasks[p].empty())
+            return true;
+    return false;
 }
 
 void Balau::TaskMan::stop(int code) {
     s_scheduler.stopAll(code);
 }
 
+static void pinThread(const std::vector<int> & cpus) {
+    if (cpus.empty())
+        return;
+#ifdef __linux
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+        CPU_SET(cpu, &set);
+    int r = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (r != 0)
+        Balau::Printer::log(Balau::M_WARNING, "Unable to pin TaskMan thread to %zu cpu(s): error %i", cpus.size(), r);
+#else
+    Balau::Printer::log(Balau::M_WARNING, "Pinning TaskMan threads isn't supported on this platform");
+#endif
+}
+
+std::vector<int> Balau::TaskMan::getNodeCPUs(int node) {
+    std::vector<int> r;
+#ifdef __linux
+    char path[128];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%i/cpulist", node);
+    FILE * f = fopen(path, "r");
+    if (!f) {
+        Balau::Printer::log(Balau::M_WARNING, "Unable to read the CPU list of NUMA node %i", node);
+        return r;
+    }
+    // the format is a list of ranges, like "0-3,8-11"
+    int first, last;
+    char sep;
+    while (fscanf(f, "%i", &first) == 1) {
+        last = first;
+        sep = fgetc(f);
+        if (sep == '-') {
+            if (fscanf(f, "%i", &last) != 1)
+                break;
+            sep = fgetc(f);
+        }
+        for (int cpu = first; cpu <= last; cpu++)
+            r.push_back(cpu);
+        if (sep != ',')
+            break;
+    }
+    fclose(f);
+#endif
+    return r;
+}
+
+Balau::TaskMan * Balau::TaskMan::TaskManThread::getTaskMan() {
+    if (!m_gotCreated) {
+        // without a task to put to sleep, there's no event loop to wake us up either; this only lasts for the
+        // thread's startup.
+        if (!Task::getCurrentTask()) {
+            while (m_created.isEmpty())
+                sched_yield();
+        }
+        m_createdTaskMan = m_created.pop();
+        m_gotCreated = true;
+    }
+    return m_createdTaskMan;
+}
+
 void * Balau::TaskMan::TaskManThread::proc() {
     bool success = false;
+    bool created = false;
     m_taskMan = NULL;
+    // pinning first, so that the TaskMan's memory is allocated on the right node.
+    pinThread(m_cpus);
     try {
         m_taskMan = new Balau::TaskMan();
+        m_created.push(m_taskMan);
+        created = true;
         m_taskMan->mainLoop();
         success = true;
     }
@@ -770,6 +1243,8 @@ void * Balau::TaskMan::TaskManThread::proc() {
     catch (...) {
         Printer::log(M_ERROR | M_ALERT, "The TaskMan thread caused an unknown exception");
     }
+    if (!created)
+        m_created.push(NULL);
     if (!success) {
         if (m_taskMan)
             delete m_taskMan;
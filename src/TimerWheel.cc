@@ -0,0 +1,156 @@
+#include "TimerWheel.h"
+#include "Task.h"
+#include "TaskMan.h"
+
+Balau::TimerWheel::TimerWheel(struct ev_loop * loop) : m_loop(loop) {
+    for (int i = 0; i < ROOT_SIZE; i++)
+        m_root[i] = NULL;
+    for (int l = 0; l < (LEVELS - 1); l++)
+        for (int i = 0; i < LEVEL_SIZE; i++)
+            m_levels[l][i] = NULL;
+    m_now = currentTick();
+    m_timer.set(m_loop);
+    m_timer.set<TimerWheel, &TimerWheel::evt_cb>(this);
+}
+
+Balau::TimerWheel::~TimerWheel() {
+    m_timer.stop();
+    for (int i = 0; i < ROOT_SIZE; i++)
+        while (m_root[i])
+            remove(m_root[i]);
+    for (int l = 0; l < (LEVELS - 1); l++)
+        for (int i = 0; i < LEVEL_SIZE; i++)
+            while (m_levels[l][i])
+                remove(m_levels[l][i]);
+}
+
+void Balau::TimerWheel::add(Events::CoarseTimeout * t, ev_tstamp delay) {
+    // nothing is in there, so nothing needs to cascade; just catch up with the clock.
+    if (m_count == 0)
+        m_now = currentTick();
+    t->m_wheel = this;
+    // rounding up, so that we never fire early.
+    t->m_expires = uint64_t((ev_now(m_loop) + delay) / TICK) + 1;
+    m_count++;
+    insert(t);
+    if ((m_count == 1) || (t->m_expires < m_armedFor))
+        arm();
+}
+
+void Balau::TimerWheel::insert(Events::CoarseTimeout * t) {
+    uint64_t expires = t->m_expires;
+    // while cascading, timeouts expiring right now go in the root slot that's about to be processed.
+    if (expires < m_now)
+        expires = m_now;
+    uint64_t delta = expires - m_now;
+    // too far in the future; it'll get re-inserted when that slot comes up.
+    if (delta > MAX_DELTA)
+        expires = m_now + MAX_DELTA;
+
+    Events::CoarseTimeout ** slot;
+    if (delta < ROOT_SIZE) {
+        slot = &m_root[expires & (ROOT_SIZE - 1)];
+    } else {
+        int level = 0;
+        while ((level < (LEVELS - 2)) && (delta >= (uint64_t(1) << (ROOT_BITS + (level + 1) * LEVEL_BITS))))
+            level++;
+        slot = &m_levels[level][(expires >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1)];
+    }
+
+    t->m_wheelSlot = slot;
+    t->m_wheelPrev = NULL;
+    t->m_wheelNext = *slot;
+    if (*slot)
+        (*slot)->m_wheelPrev = t;
+    *slot = t;
+}
+
+void Balau::TimerWheel::remove(Events::CoarseTimeout * t) {
+    IAssert(t->m_wheel == this, "CoarseTimeout at %p isn't in TimerWheel %p", t, this);
+    if (t->m_wheelPrev)
+        t->m_wheelPrev->m_wheelNext = t->m_wheelNext;
+    else
+        *t->m_wheelSlot = t->m_wheelNext;
+    if (t->m_wheelNext)
+        t->m_wheelNext->m_wheelPrev = t->m_wheelPrev;
+    t->m_wheelPrev = t->m_wheelNext = NULL;
+    t->m_wheelSlot = NULL;
+    t->m_wheel = NULL;
+    if (--m_count == 0)
+        m_timer.stop();
+}
+
+void Balau::TimerWheel::cascade(int level, int idx) {
+    Events::CoarseTimeout * t = m_levels[level][idx];
+    m_levels[level][idx] = NULL;
+    while (t) {
+        Events::CoarseTimeout * next = t->m_wheelNext;
+        insert(t);
+        t = next;
+    }
+}
+
+void Balau::TimerWheel::step() {
+    m_now++;
+    int idx = m_now & (ROOT_SIZE - 1);
+    // the root wheel wrapped around; pull the next slot of each level down, as far as needed.
+    if (idx == 0) {
+        for (int level = 0; level < (LEVELS - 1); level++) {
+            int levelIdx = (m_now >> (ROOT_BITS + level * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+            cascade(level, levelIdx);
+            if (levelIdx != 0)
+                break;
+        }
+    }
+
+    Events::CoarseTimeout * t;
+    while ((t = m_root[idx])) {
+        remove(t);
+        if (t->m_expires > m_now) {
+            // got clamped at insertion time
+            m_count++;
+            t->m_wheel = this;
+            insert(t);
+            continue;
+        }
+        t->doSignal();
+    }
+}
+
+void Balau::TimerWheel::advance(uint64_t tick) {
+    while ((m_now < tick) && (m_count != 0))
+        step();
+}
+
+// the next tick with something to do: a root slot holding timeouts, or the root wheel wrapping around, which
+// may cascade timeouts down. That's at most ROOT_SIZE ticks away.
+uint64_t Balau::TimerWheel::nextTick() {
+    uint64_t tick = m_now + 1;
+    while (((tick & (ROOT_SIZE - 1)) != 0) && !m_root[tick & (ROOT_SIZE - 1)])
+        tick++;
+    return tick;
+}
+
+void Balau::TimerWheel::arm() {
+    m_armedFor = nextTick();
+    // a bit past the tick's boundary, so that currentTick() is sure to have gotten there.
+    ev_tstamp delay = m_armedFor * TICK - ev_now(m_loop) + TICK / 16;
+    m_timer.stop();
+    m_timer.start(delay > 0 ? delay : 0, 0);
+}
+
+void Balau::TimerWheel::evt_cb(ev::timer & w, int revents) {
+    advance(currentTick());
+    if (m_count != 0)
+        arm();
+}
+
+void Balau::Events::CoarseTimeout::gotOwner(Task * task) {
+    cancel();
+    task->getTaskMan()->getTimerWheel()->add(this, m_delay);
+}
+
+void Balau::Events::CoarseTimeout::cancel() {
+    if (m_wheel)
+        m_wheel->remove(this);
+}
@@ -1,7 +1,9 @@
+#include <algorithm>
 #include "ZHandle.h"
 #include "Task.h"
 #include "Async.h"
 #include "TaskMan.h"
+#include "IOBufferPool.h"
 
 Balau::ZStream::ZStream(IO<Handle> h, int level, header_t header) : Filter(h) {
     m_zin.zalloc = m_zout.zalloc = NULL;
@@ -24,19 +26,25 @@ Balau::ZStream::ZStream(IO<Handle> h, int level, header_t header) : Filter(h) {
 }
 
 void Balau::ZStream::close() throw (GeneralException) {
+    bool abandoned = false;
     switch (m_phase) {
+    case COMPRESSING:
+    case DECOMPRESSING:
+        if (m_op) {
+            // a read or write got abandoned with zlib still working on our streams; no point in finishing them now.
+            abandonAsyncOp();
+            abandoned = true;
+        }
     case IDLE:
     case WRITING_FINISH:
     case COMPRESSING_FINISH:
     case COMPRESSING_FINISH_IDLE:
-        if (getIO()->canWrite())
+        if (!abandoned && getIO()->canWrite())
             finish();
         inflateEnd(&m_zin);
         deflateEnd(&m_zout);
-        if (m_buf) {
-            free(m_buf);
-            m_buf = NULL;
-        }
+        releaseBuf(m_inBuf, m_inBufSize);
+        releaseBuf(m_outBuf, m_outBufSize);
         m_phase = CLOSING;
     case CLOSING:
         Filter::close();
@@ -49,16 +57,27 @@ void Balau::ZStream::close() throw (GeneralException) {
 
 namespace {
 
+// how much zlib gets fed at a time by AsyncOpZlib
+static const uInt s_zlibSlice = 64 * 1024;
+
 class AsyncOpZlib : public Balau::AsyncOperation {
   public:
       AsyncOpZlib(z_stream * z, bool deflate, int flush) : m_z(z), m_deflate(deflate), m_flush(flush) { }
     virtual bool needsMainQueue() { return false; }
     virtual bool needsFinishWorker() { return true; }
     virtual void run() {
-        if (m_deflate)
-            m_r = deflate(m_z, m_flush);
-        else
-            m_r = inflate(m_z, Z_SYNC_FLUSH);
+        // feed zlib a slice at a time, so a cancel is noticed without going through the whole buffer first.
+        uInt left = m_z->avail_in;
+        do {
+            uInt slice = std::min(left, s_zlibSlice);
+            m_z->avail_in = slice;
+            if (m_deflate)
+                m_r = deflate(m_z, slice == left ? m_flush : Z_NO_FLUSH);
+            else
+                m_r = inflate(m_z, Z_SYNC_FLUSH);
+            left -= slice - m_z->avail_in;
+            m_z->avail_in = left;
+        } while ((m_r == Z_OK) && (left != 0) && (m_z->avail_out != 0) && !isCanceled());
     }
     virtual void done() { m_evt.doSignal(); }
     bool gotSignal() { return m_evt.gotSignal(); }
@@ -73,6 +92,28 @@ class AsyncOpZlib : public Balau::AsyncOperation {
 
 };
 
+void Balau::ZStream::abandonAsyncOp() {
+    AsyncOpZlib * async = dynamic_cast<AsyncOpZlib *>(m_op);
+    async->cancel();
+    // it still holds our z_stream until it's done
+    if (!async->gotSignal())
+        async->yield();
+    delete async;
+    m_op = NULL;
+}
+
+void Balau::ZStream::acquireBuf(uint8_t * & buf, size_t & bufSize, size_t size) {
+    if (buf)
+        return;
+    bufSize = size;
+    buf = IOBufferPool::acquire(bufSize);
+}
+
+void Balau::ZStream::releaseBuf(uint8_t * & buf, size_t bufSize) {
+    IOBufferPool::release(buf, bufSize);
+    buf = NULL;
+}
+
 bool Balau::ZStream::isPendingComplete() {
     AsyncOpZlib * async = dynamic_cast<AsyncOpZlib *>(m_op);
 
@@ -109,18 +150,22 @@ ssize_t Balau::ZStream::read(void * buf, size_t count) throw (GeneralException)
         m_count = count;
         m_zin.next_out = (Bytef *) buf;
         m_zin.avail_out = count;
-        if (!m_buf) {
-            m_zin.next_in = m_buf = (uint8_t *) malloc(block_size);
+        if (!m_inBuf) {
+            acquireBuf(m_inBuf, m_inBufSize, block_size);
+            m_zin.next_in = m_inBuf;
             m_zin.avail_in = 0;
         }
         while ((m_count != 0) && !getIO()->isClosed() && !getIO()->isEOF()) {
             if (m_zin.avail_in == 0) {
-                m_zin.next_in = m_buf;
+                m_zin.next_in = m_inBuf;
                 m_phase = READING;
     case READING:
-                m_status = getIO()->read(m_buf, block_size);
-                if (m_status <= 0)
+                m_status = getIO()->read(m_inBuf, block_size);
+                if (m_status <= 0) {
+                    releaseBuf(m_inBuf, m_inBufSize);
+                    m_phase = IDLE;
                     return m_total;
+                }
                 m_zin.avail_in = m_status;
             }
             if (m_useAsyncOp) {
@@ -142,6 +187,7 @@ ssize_t Balau::ZStream::read(void * buf, size_t count) throw (GeneralException)
             m_total += didRead;
             m_count -= didRead;
             if (m_status == Z_STREAM_END) {
+                releaseBuf(m_inBuf, m_inBufSize);
                 m_eof = true;
                 m_phase = IDLE;
                 return m_total;
@@ -152,6 +198,9 @@ ssize_t Balau::ZStream::read(void * buf, size_t count) throw (GeneralException)
         AAssert(false, "Don't call an operation without finishing another.");
     }
 
+    // compressed bytes left over for the next read have to stay with us.
+    if (m_zin.avail_in == 0)
+        releaseBuf(m_inBuf, m_inBufSize);
     m_phase = IDLE;
     return m_total;
 }
@@ -172,10 +221,9 @@ ssize_t Balau::ZStream::write(const void * buf, size_t count) throw (GeneralExce
         m_count = count;
         m_zout.next_in = (Bytef *) const_cast<void *>(buf);
         m_zout.avail_in = count;
-        if (!m_buf)
-            m_buf = (uint8_t *) malloc(block_size);
+        acquireBuf(m_outBuf, m_outBufSize, block_size);
         while ((m_count != 0) && !getIO()->isClosed()) {
-            m_zout.next_out = (Bytef *) m_buf;
+            m_zout.next_out = (Bytef *) m_outBuf;
             m_zout.avail_out = block_size;
             if (m_useAsyncOp) {
                 m_phase = DECOMPRESSING;
@@ -194,11 +242,12 @@ ssize_t Balau::ZStream::write(const void * buf, size_t count) throw (GeneralExce
             EAssert(m_status == Z_OK, "deflate() didn't return Z_OK but %zi", m_status);
             m_compressed = block_size - m_zout.avail_out;
             m_phase = WRITING;
-            m_wptr = m_buf;
+            m_wptr = m_outBuf;
             while (m_compressed) {
     case WRITING:
                 w = getIO()->write(m_wptr, m_compressed);
                 if (w <= 0) {
+                    releaseBuf(m_outBuf, m_outBufSize);
                     m_phase = IDLE;
                     return m_total;
                 }
@@ -214,6 +263,7 @@ ssize_t Balau::ZStream::write(const void * buf, size_t count) throw (GeneralExce
         AAssert(false, "Don't call an operation without finishing another.");
     }
 
+    releaseBuf(m_outBuf, m_outBufSize);
     m_phase = IDLE;
     return m_total;
 }
@@ -222,16 +272,16 @@ void Balau::ZStream::doFlush(bool finish) {
     AAssert(getIO()->canWrite(), "Can't call ZStream::doFlush on a non-writable handle.");
 
     const int block_size = BLOCK_SIZE * (m_useAsyncOp ? 16 : 1);
-    void * buf = m_useAsyncOp ? malloc(block_size) : alloca(block_size);
     AsyncOpZlib * async = dynamic_cast<AsyncOpZlib *>(m_op);
     ssize_t w = 0;
 
     switch (m_phase) {
     case IDLE:
+        acquireBuf(m_outBuf, m_outBufSize, block_size);
         m_zout.next_in = NULL;
         m_zout.avail_in = 0;
         do {
-            m_zout.next_out = (Bytef *) m_buf;
+            m_zout.next_out = (Bytef *) m_outBuf;
             m_zout.avail_out = block_size;
             if (m_useAsyncOp) {
                 m_phase = COMPRESSING_FINISH;
@@ -250,11 +300,12 @@ void Balau::ZStream::doFlush(bool finish) {
             EAssert((m_status == Z_OK) || ((m_status == Z_STREAM_END) && finish), "deflate() didn't return Z_OK or Z_STREAM_END, but %zi (finish = %s)", m_status, finish ? "true" : "false");
             m_compressed = block_size - m_zout.avail_out;
             m_phase = WRITING_FINISH;
-            m_wptr = m_buf;
+            m_wptr = m_outBuf;
             while (m_compressed) {
     case WRITING_FINISH:
                 w = getIO()->write(m_wptr, m_compressed);
                 if (w <= 0) {
+                    releaseBuf(m_outBuf, m_outBufSize);
                     m_phase = IDLE;
                     return;
                 }
@@ -267,5 +318,6 @@ void Balau::ZStream::doFlush(bool finish) {
         AAssert(false, "Don't call an operation without finishing another.");
     }
 
+    releaseBuf(m_outBuf, m_outBufSize);
     m_phase = IDLE;
 }
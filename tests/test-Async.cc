@@ -2,6 +2,7 @@
 #include <Task.h>
 #include <TaskMan.h>
 #include <Main.h>
+#include <Parallel.h>
 
 using namespace Balau;
 
@@ -38,6 +39,49 @@ class AsyncOpTest : public AsyncOperation {
     Events::Custom * m_evt;
 };
 
+class AsyncOpOrdered : public AsyncOperation {
+  public:
+      AsyncOpOrdered(int index, std::atomic<int> * next) : m_index(index), m_next(next) { }
+    virtual void run() { m_inOrder = m_next->fetch_add(1) == m_index; }
+    virtual void done() { m_evt.doSignal(); }
+    virtual intptr_t orderingKey() { return 42; }
+
+    int m_index;
+    std::atomic<int> * m_next;
+    bool m_inOrder = false;
+    Events::Custom m_evt;
+};
+
+class AsyncOpCounter : public AsyncOperation {
+  public:
+      AsyncOpCounter(std::atomic<int> * counter) : m_counter(counter) { }
+    virtual void run() { ++*m_counter; }
+    virtual void done() { delete this; }
+
+    std::atomic<int> * m_counter;
+};
+
+class AsyncOpDetached : public AsyncOpCounter {
+  public:
+      AsyncOpDetached(std::atomic<int> * counter) : AsyncOpCounter(counter) { }
+    virtual bool needsSynchronousCallback() { return false; }
+};
+
+class AsyncOpSlow : public AsyncOperation {
+  public:
+      AsyncOpSlow(std::atomic<int> * ran) : m_ran(ran) { }
+    virtual void run() {
+        ev_tstamp until = ev_time() + 0.02;
+        while (ev_time() < until);
+        ++*m_ran;
+    }
+    virtual void done() { delete this; }
+    virtual bool needsMainQueue() { return false; }
+    virtual bool needsFinishWorker() { return true; }
+
+    std::atomic<int> * m_ran;
+};
+
 void MainTask::Do() {
     Printer::log(M_STATUS, "Test::Async running.");
 
@@ -52,5 +96,158 @@ void MainTask::Do() {
     TAssert(op->m_done);
     delete op;
 
+    AsyncFinisherStats finisherStats = TaskMan::getAsyncFinisherStats();
+    TAssert(finisherStats.ops >= 1);
+    TAssert(finisherStats.finishers >= 1);
+    TAssert(finisherStats.finishers <= finisherStats.maxFinishers);
+
+    // a backlog of slow operations grows the finishers pool; once it's gone, the pool shrinks back to its idle bound.
+    TaskMan::setAsyncFinishers(1, 2);
+    TaskMan::setAsyncFinishersTarget(8, 0.001);
+    std::atomic<int> slowRan(0);
+    static const int SLOW = 32;
+    for (int i = 0; i < SLOW; i++)
+        createAsyncOp(new AsyncOpSlow(&slowRan));
+    while (slowRan.load() != SLOW)
+        sleep(0.01);
+    AsyncFinisherStats grownStats = TaskMan::getAsyncFinisherStats();
+    TAssert(grownStats.grown > finisherStats.grown);
+    for (int i = 0; (i < 500) && (TaskMan::getAsyncFinisherStats().finishers > 2); i++)
+        sleep(0.01);
+    TAssert(TaskMan::getAsyncFinisherStats().finishers <= 2);
+    TaskMan::setAsyncFinishers(1, 4);
+    TaskMan::setAsyncFinishersTarget(AsyncManager::getCPUCount(), 0.002);
+
+    TaskMan::setAsyncWorkers(4);
+    std::atomic<int> next(0);
+    static const int N = 16;
+    AsyncOpOrdered * ops[N];
+    // resizing halfway through moves key 42 to another shard; the ones still in flight must not get overtaken.
+    for (int i = 0; i < N; i++) {
+        if (i == N / 2)
+            TaskMan::setAsyncWorkers(6);
+        ops[i] = createAsyncOp(new AsyncOpOrdered(i, &next));
+    }
+    for (int i = 0; i < N; i++) {
+        waitFor(&ops[i]->m_evt);
+        while (!ops[i]->m_evt.gotSignal())
+            yield();
+        TAssert(ops[i]->m_inOrder);
+        delete ops[i];
+    }
+    TaskMan::setAsyncWorkers(4);
+
+    // a batch of keyed operations takes their key, so the ones queued behind it can't overtake it.
+    next = 0;
+    AsyncBatch ordered;
+    for (int i = 0; i < N / 2; i++) {
+        ops[i] = new AsyncOpOrdered(i, &next);
+        ordered.add(ops[i]);
+    }
+    ordered.submit();
+    for (int i = N / 2; i < N; i++)
+        ops[i] = createAsyncOp(new AsyncOpOrdered(i, &next));
+    ordered.wait();
+    for (int i = 0; i < N; i++) {
+        waitFor(&ops[i]->m_evt);
+        while (!ops[i]->m_evt.gotSignal())
+            yield();
+        TAssert(ops[i]->m_inOrder);
+        delete ops[i];
+    }
+    uint64_t total = 0;
+    for (auto & stats : TaskMan::getAsyncStats())
+        total += stats.ops;
+    TAssert(TaskMan::getAsyncStats().size() == 4);
+    TAssert(total >= N);
+
+    std::atomic<int> counter(0);
+    AsyncBatch all;
+    for (int i = 0; i < N; i++)
+        all.add(new AsyncOpCounter(&counter));
+    all.submit();
+    all.wait();
+    TAssert(all.isDone());
+    TAssert(all.completed() == N);
+    TAssert(counter.load() == N);
+
+    AsyncBatch any(AsyncBatch::ANY);
+    for (int i = 0; i < N; i++)
+        any.add(new AsyncOpCounter(&counter));
+    any.submit();
+    any.wait();
+    TAssert(any.completed() >= 1);
+    any.waitAll();
+    TAssert(any.completed() == N);
+    TAssert(counter.load() == 2 * N);
+
+    AsyncBatch canceled;
+    for (int i = 0; i < N; i++)
+        canceled.add(new AsyncOpCounter(&counter));
+    canceled.cancel();
+    canceled.submit();
+    canceled.waitAll();
+    TAssert(canceled.isCanceled());
+    TAssert(canceled.completed() == 0);
+    TAssert(counter.load() == 2 * N);
+
+    // whether the worker got to it first or not, wait() has to come back, and only what ran counts.
+    AsyncBatch late(AsyncBatch::ANY);
+    for (int i = 0; i < N; i++)
+        late.add(new AsyncOpCounter(&counter));
+    late.submit();
+    late.cancel();
+    late.wait();
+    late.waitAll();
+    TAssert(late.completed() == counter.load() - 2 * N);
+    counter = 2 * N;
+
+    static const int RANGE = 100000;
+    std::vector<int> squares(RANGE);
+    parallelFor(0, RANGE, [&](int from, int to) { for (int i = from; i < to; i++) squares[i] = i % 1000 * (i % 1000); }, 1000);
+    int64_t sum = parallelReduce(0, RANGE, (int64_t) 0, [&](int from, int to) {
+        int64_t partial = 0;
+        for (int i = from; i < to; i++)
+            partial += squares[i];
+        return partial;
+    }, [](int64_t a, int64_t b) { return a + b; }, 1000);
+    TAssert(sum == 332833500LL * (RANGE / 1000));
+    bool thrown = false;
+    try {
+        parallelFor(0, RANGE, [](int from, int to) { if (from == 0) throw GeneralException("chunk failed"); });
+    }
+    catch (GeneralException & e) {
+        thrown = true;
+    }
+    TAssert(thrown);
+
+    int captured = 21;
+    Offloaded<int> answer = offload([captured]() { return captured * 2; });
+    Offloaded<void> failing = offload([]() { throw GeneralException("offloaded call failed"); });
+    TAssert(answer.get() == 42);
+    thrown = false;
+    try {
+        failing.get();
+    }
+    catch (GeneralException & e) {
+        thrown = true;
+    }
+    TAssert(thrown);
+    { Offloaded<int> dropped = offload([]() { return 0; }); }
+
+    // what a short-lived process pays to bring an AsyncManager up, push an operation through it, and tear it down.
+    static const int STARTS = 20;
+    counter = 0;
+    ev_tstamp start = ev_time();
+    for (int i = 0; i < STARTS; i++) {
+        AsyncManager manager;
+        manager.threadStart();
+        manager.queueOp(new AsyncOpDetached(&counter));
+        manager.join();
+    }
+    ev_tstamp elapsed = ev_time() - start;
+    Printer::log(M_STATUS, "AsyncManager startup and teardown: %.3fms on average", elapsed * 1000 / STARTS);
+    TAssert(counter.load() == STARTS);
+
     Printer::log(M_STATUS, "Test::Async passed.");
 }
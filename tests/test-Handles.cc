@@ -2,9 +2,13 @@
 #include <Input.h>
 #include <Output.h>
 #include <Buffer.h>
+#include <SegmentedBuffer.h>
 #include <BStream.h>
 #include <ZHandle.h>
 #include <TaskMan.h>
+#include <IoUring.h>
+#include <FreeList.h>
+#include <IOBufferPool.h>
 #include <StacklessTask.h>
 
 #ifdef _WIN32
@@ -103,6 +107,84 @@ DataGenerator dg;
 
 using namespace Balau;
 
+// every operator new, from any thread; the free lists' own mallocs are counted by freeListMallocs().
+static std::atomic<uint64_t> s_news(0);
+
+void * operator new(size_t size) {
+    ++s_news;
+    void * r = malloc(size ? size : 1);
+    if (!r)
+        throw std::bad_alloc();
+    return r;
+}
+
+void operator delete(void * ptr) noexcept {
+    free(ptr);
+}
+
+static uint64_t allocations() {
+    return s_news.load() + freeListMallocs().load();
+}
+
+// reads the whole of h through a BStream, in small reads, and logs the throughput; blockSize 0 means adaptive.
+static void benchStream(const char * what, IO<Handle> h, size_t blockSize, size_t expected) {
+    IO<BStream> strm(new BStream(h, blockSize ? blockSize : BStream::DEFAULT_BLOCK_SIZE));
+    strm->detach();
+    strm->setAdaptive(blockSize == 0);
+    // also turns buffering on for the Buffer, which would otherwise go straight through.
+    strm->peekNextByte();
+    uint8_t buf[1000];
+    size_t total = 0;
+    ssize_t r;
+    ev_tstamp start = ev_time();
+    while ((r = strm->read(buf, sizeof(buf))) > 0)
+        total += r;
+    ev_tstamp elapsed = ev_time() - start;
+    TAssert(total == expected);
+    Printer::log(M_STATUS, "BStream over %s, block size %zu%s: %.1f MB/s", what, strm->getBlockSize(), blockSize ? "" : " (adaptive)", total / elapsed / (1024 * 1024));
+}
+
+// 1-byte reads all over i, whose contents are in ref; returns how many allocations they took.
+static uint64_t smallReads(IO<Input> i, const char * ref, off64_t size, const char * path) {
+    static const int READS = 1000;
+    char c;
+    // warms the free lists up
+    i->rseek(0, SEEK_SET);
+    ssize_t r = i->read(&c, 1);
+    TAssert(r == 1);
+    uint64_t before = allocations();
+    ev_tstamp start = ev_time();
+    for (int n = 0; n < READS; n++) {
+        i->rseek(n % size, SEEK_SET);
+        r = i->read(&c, 1);
+        TAssert(r == 1);
+        TAssert(c == ref[n % size]);
+    }
+    ev_tstamp elapsed = ev_time() - start;
+    uint64_t allocated = allocations() - before;
+    Printer::log(M_STATUS, "%i small reads through %s: %.3fus each, %" PRIu64 " allocations", READS, path, elapsed * 1000000 / READS, allocated);
+    return allocated;
+}
+
+// open, stat, write and close a file, then open, stat, read and close it back.
+static void fileRoundTrip(const char * fname) {
+    static const char data[] = "through the ring\n";
+    IO<Output> o(new Output(fname));
+    o->open();
+    TAssert(o->getSize() == 0);
+    ssize_t r = o->forceWrite(data, sizeof(data) - 1);
+    TAssert(r == (ssize_t) (sizeof(data) - 1));
+    o->close();
+    IO<Input> i(new Input(fname));
+    i->open();
+    TAssert(i->getSize() == (off64_t) (sizeof(data) - 1));
+    char buf[sizeof(data) - 1];
+    r = i->forceRead(buf, sizeof(buf));
+    TAssert(r == (ssize_t) (sizeof(data) - 1));
+    TAssert(memcmp(buf, data, r) == 0);
+    i->close();
+}
+
 class SimpleTaskTest : public Task {
     virtual void Do();
     const char * getName() const { return "SimpleTaskTest"; }
@@ -155,13 +237,80 @@ void SimpleTaskTest::Do() {
     TAssert(r == (s - 5));
     TAssert(memcmp(buf1, buf2, s) == 0);
 
+    // once the free lists are warm, small reads shouldn't allocate anything anymore, whichever way they go.
+#ifdef HAVE_IO_URING
+    TAssert(smallReads(i, buf1, s, "the ring") == 0);
+    getTaskMan()->useIoUring(false);
+#endif
+    TAssert(smallReads(i, buf1, s, "the async threads") == 0);
+#ifdef HAVE_IO_URING
+    getTaskMan()->useIoUring(true);
+#endif
+    i->fadvise(0, 0, Input::ADVICE_SEQUENTIAL);
+    i->readahead(0, 0);
+
     IO<Output> o(new Output("tests/out.txt"));
     o->open();
     s = o->wtell();
     TAssert(s == 0);
     s = o->getSize();
     TAssert(s == 0);
+    o->preallocate(4096);
     o->writeString("foo\n");
+    o->datasync();
+    o->sync();
+    TAssert(o->wtell() == 4);
+    struct iovec wv[3] = { { (void *) "bar", 3 }, { NULL, 0 }, { (void *) "baz\n", 4 } };
+    r = o->forceWritev(wv, 3);
+    TAssert(r == 7);
+    TAssert(o->wtell() == 11);
+    o->close();
+    IO<Input> check(new Input("tests/out.txt"));
+    check->open();
+    char part1[4], part2[7];
+    struct iovec rv[2] = { { part1, sizeof(part1) }, { part2, sizeof(part2) } };
+    r = check->readv(rv, 2);
+    TAssert(r == 11);
+    TAssert(memcmp(part1, "foo\n", 4) == 0);
+    TAssert(memcmp(part2, "barbaz\n", 7) == 0);
+    check->rseek(0);
+    IO<Buffer> copy(new Buffer());
+    r = check->transferTo(copy, 1024);
+    TAssert(r == 11);
+    TAssert(memcmp(copy->getBuffer(), "foo\nbarbaz\n", 11) == 0);
+    check->close();
+
+    o = new Output("tests/prealloc.txt");
+    o->open();
+    if (o->preallocate(8192, false)) {
+        TAssert(o->getSize() == 8192);
+    } else {
+        Printer::log(M_STATUS, "Preallocating isn't supported here");
+    }
+    o->close();
+    check = new Input("tests/prealloc.txt");
+    check->open();
+    TAssert(check->getSize() == o->getSize());
+    check->close();
+
+#ifdef HAVE_IO_URING
+    {
+        IoUring * ring = getTaskMan()->getIoUring();
+        if (ring) {
+            uint64_t before = ring->completed();
+            fileRoundTrip("tests/uring.txt");
+            TAssert(ring->completed() - before == 8);
+        } else {
+            Printer::log(M_STATUS, "No io_uring on this kernel; skipping the ring path");
+        }
+        // and the same without the ring, which then has to stay out of it.
+        getTaskMan()->useIoUring(false);
+        uint64_t before = ring ? ring->completed() : 0;
+        fileRoundTrip("tests/uring.txt");
+        TAssert(!ring || (ring->completed() == before));
+        getTaskMan()->useIoUring(true);
+    }
+#endif
 
     IO<Handle> b(new Buffer());
     s = b->rtell();
@@ -196,6 +345,89 @@ void SimpleTaskTest::Do() {
     TAssert(s == 12);
     TAssert(b->isEOF());
 
+    {
+        // straddles three segments, then gets read back and flattened through the segments.
+        IO<SegmentedBuffer> sb(new SegmentedBuffer());
+        static const size_t SEG = SegmentedBuffer::SEGMENT_SIZE;
+        uint8_t pattern[SEG + 100];
+        for (size_t i = 0; i < sizeof(pattern); i++)
+            pattern[i] = (uint8_t) (i * 7);
+        r = sb->write(pattern, sizeof(pattern));
+        TAssert(r == (ssize_t) sizeof(pattern));
+        r = sb->write(pattern, sizeof(pattern));
+        TAssert(sb->getSize() == (off64_t) (2 * sizeof(pattern)));
+        TAssert(sb->numSegments() == 3);
+        struct iovec iov[4];
+        TAssert(sb->getSegments(iov, 4, 0) == 3);
+        TAssert(iov[0].iov_len == SEG);
+        TAssert(sb->getSegments(iov, 4, SEG + 10) == 2);
+        TAssert(iov[0].iov_len == SEG - 10);
+        uint8_t back[SEG + 100];
+        sb->rseek(sizeof(pattern));
+        r = sb->read(back, sizeof(back));
+        TAssert(r == (ssize_t) sizeof(back));
+        TAssert(memcmp(back, pattern, sizeof(pattern)) == 0);
+        TAssert(sb->isEOF());
+        sb->rseek(0);
+        IO<Buffer> flat(new Buffer());
+        r = sb->transferTo(flat, 1 << 20);
+        TAssert(r == (ssize_t) (2 * sizeof(pattern)));
+        TAssert(memcmp(flat->getBuffer() + sizeof(pattern), pattern, sizeof(pattern)) == 0);
+    }
+
+    {
+        size_t size = 5000;
+        uint8_t * p1 = IOBufferPool::acquire(size);
+        TAssert(size == 8192);
+        IOBufferPool::release(p1, size);
+        IOBufferPool::Stats before = IOBufferPool::getStats();
+        uint8_t * p2 = IOBufferPool::acquire(size);
+        TAssert(p2 == p1);
+        TAssert(IOBufferPool::getStats().hits == before.hits + 1);
+        IOBufferPool::release(p2, size);
+
+        // a stream only holds on to a buffer while it has data in it.
+        IO<Input> in(new Input("tests/out.txt"));
+        in->open();
+        IO<BStream> strm(new BStream(in));
+        String line = strm->readString();
+        TAssert(line == "foo");
+        TAssert(IOBufferPool::getStats().inUse > before.inUse);
+        line = strm->readString();
+        TAssert(line == "barbaz");
+        TAssert(IOBufferPool::getStats().inUse == before.inUse);
+    }
+
+    {
+        static const size_t BENCH_SIZE = 16 * 1024 * 1024;
+        static const size_t blockSizes[] = { 4 * 1024, 16 * 1024, 128 * 1024, 1024 * 1024, 0 };
+        uint8_t chunk[64 * 1024];
+        for (size_t n = 0; n < sizeof(chunk); n++)
+            chunk[n] = (uint8_t) n;
+        IO<Buffer> mem(new Buffer());
+        IO<Output> bench(new Output("tests/bench.bin"));
+        bench->open();
+        for (size_t n = 0; n < BENCH_SIZE; n += sizeof(chunk)) {
+            r = mem->forceWrite(chunk, sizeof(chunk));
+            r = bench->forceWrite(chunk, sizeof(chunk));
+        }
+        bench->close();
+        for (size_t blockSize : blockSizes) {
+            mem->rseek(0);
+            benchStream("Buffer", mem, blockSize, BENCH_SIZE);
+            IO<Input> in(new Input("tests/bench.bin"));
+            in->open();
+            benchStream("Input", in, blockSize, BENCH_SIZE);
+        }
+
+        IO<Input> in(new Input("tests/bench.bin"));
+        in->open();
+        IO<BStream> strm(new BStream(in));
+        strm->setAdaptive(true);
+        while ((r = strm->read(chunk, 1000)) > 0);
+        TAssert(strm->getBlockSize() > BStream::DEFAULT_BLOCK_SIZE);
+    }
+
     {
         IO<Output> o(new Output("tests/out.z"));
         o->open();
@@ -252,6 +484,33 @@ void SimpleTaskTest::Do() {
         String f = s->readString();
         TAssert(f == "foobar");
     }
+
+    {
+        // vectored calls have to go through the compression too.
+        IO<Output> o(new Output("tests/outv.z"));
+        o->open();
+        IO<ZStream> z(new ZStream(o));
+        z->detach();
+        struct iovec wv[3] = { { (void *) "foo", 3 }, { (void *) "bar", 3 }, { (void *) "baz\n", 4 } };
+        ssize_t w = z->forceWritev(wv, 3);
+        TAssert(w == 10);
+    }
+
+    {
+        IO<Input> i(new Input("tests/outv.z"));
+        i->open();
+        IO<ZStream> z(new ZStream(i));
+        z->detach();
+        char part1[6], part2[4];
+        struct iovec rv[2] = { { part1, sizeof(part1) }, { part2, sizeof(part2) } };
+        // an Input can EAgain, so the default readv may stop after the first buffer.
+        ssize_t got = z->readv(rv, 2);
+        if (got == sizeof(part1))
+            got += z->readv(rv + 1, 1);
+        TAssert(got == 10);
+        TAssert(memcmp(part1, "foobar", 6) == 0);
+        TAssert(memcmp(part2, "baz\n", 4) == 0);
+    }
 }
 
 class StacklessTaskTest : public StacklessTask {
@@ -64,7 +64,8 @@ bool StopAction::Do(HttpServer * server, Http::Request & req, HttpServer::Action
     ctx["title"] = "Stop";
     ctx["msg"] = "Server stopping";
 
-    testHtmlTemplate.htmlTemplate.render(response.get(), &ctx);
+    // built in segments, while TestAction keeps using the default Buffer.
+    testHtmlTemplate.htmlTemplate.render(response.getSegmented(), &ctx);
     response.Flush();
     return true;
 }
@@ -1,5 +1,8 @@
 #include <Main.h>
 #include <Socket.h>
+#include <BStream.h>
+#include <Input.h>
+#include <Output.h>
 
 using namespace Balau;
 
@@ -35,6 +38,58 @@ void Worker::Do() {
 
 Listener<Worker> * listener;
 
+static const size_t BENCH_SIZE = 16 * 1024 * 1024;
+
+// sends BENCH_SIZE bytes, then hangs up.
+class Streamer : public Task {
+  public:
+      Streamer(IO<Socket> io, void *) : m_io(io) { }
+    virtual const char * getName() const { return "Test streamer"; }
+    virtual void Do() {
+        uint8_t chunk[64 * 1024];
+        memset(chunk, 'z', sizeof(chunk));
+        for (size_t n = 0; n < BENCH_SIZE; n += sizeof(chunk)) {
+            ssize_t r = m_io->forceWrite(chunk, sizeof(chunk));
+            TAssert(r == sizeof(chunk));
+        }
+        m_io->close();
+    }
+    IO<Socket> m_io;
+};
+
+Listener<Streamer> * streamListener;
+
+// way more than a socket buffer, so that sendfile has to wait for the reader a few times.
+static const size_t FILE_SIZE = 8 * 1024 * 1024;
+
+static uint8_t filePattern(size_t n) { return (uint8_t) (n % 251); }
+
+// sends tests/sendfile.bin with Input::transferTo, then hangs up.
+class FileSender : public Task {
+  public:
+      FileSender(IO<Socket> io, void *) : m_io(io) { }
+    virtual const char * getName() const { return "Test file sender"; }
+    virtual void Do() {
+        IO<Input> in(new Input("tests/sendfile.bin"));
+        in->open();
+        TAssert(m_io->canReceiveFile() == (bool) SENDFILE_EXPECTED);
+        size_t total = 0;
+        ssize_t r;
+        while ((r = in->transferTo(m_io, FILE_SIZE - total)) > 0)
+            total += r;
+        TAssert(total == FILE_SIZE);
+        m_io->close();
+    }
+    IO<Socket> m_io;
+#ifdef __linux__
+    enum { SENDFILE_EXPECTED = 1 };
+#else
+    enum { SENDFILE_EXPECTED = 0 };
+#endif
+};
+
+Listener<FileSender> * fileListener;
+
 class Client : public Task {
   public:
     virtual const char * getName() const { return "Test client"; }
@@ -53,6 +108,42 @@ class Client : public Task {
         TAssert(y == 'y');
         TAssert(r == 1);
         listener->stop();
+
+        // throughput of BStream reads of 1000 bytes off a socket, depending on its block size; 0 means adaptive.
+        static const size_t blockSizes[] = { 4 * 1024, 16 * 1024, 128 * 1024, 1024 * 1024, 0 };
+        for (size_t blockSize : blockSizes) {
+            IO<Socket> b(new Socket());
+            c = b->connect("localhost", 1235);
+            TAssert(c);
+            IO<BStream> strm(new BStream(b, blockSize ? blockSize : BStream::DEFAULT_BLOCK_SIZE));
+            strm->setAdaptive(blockSize == 0);
+            uint8_t buf[1000];
+            size_t total = 0;
+            ssize_t got;
+            ev_tstamp start = ev_time();
+            while ((got = strm->read(buf, sizeof(buf))) > 0)
+                total += got;
+            ev_tstamp elapsed = ev_time() - start;
+            TAssert(total == BENCH_SIZE);
+            Printer::log(M_STATUS, "BStream over Socket, block size %zu%s: %.1f MB/s", strm->getBlockSize(), blockSize ? "" : " (adaptive)", total / elapsed / (1024 * 1024));
+        }
+        streamListener->stop();
+
+        IO<Socket> f(new Socket());
+        c = f->connect("localhost", 1236);
+        TAssert(c);
+        uint8_t buf[64 * 1024];
+        size_t total = 0;
+        bool same = true;
+        ssize_t got;
+        while ((got = f->read(buf, sizeof(buf))) > 0) {
+            for (ssize_t n = 0; n < got; n++)
+                same = same && (buf[n] == filePattern(total + n));
+            total += got;
+        }
+        TAssert(total == FILE_SIZE);
+        TAssert(same);
+        fileListener->stop();
     }
 };
 
@@ -60,23 +151,51 @@ void MainTask::Do() {
     Printer::enable(M_ALL);
     Printer::log(M_STATUS, "Test::Sockets running.");
 
+    {
+        IO<Output> o(new Output("tests/sendfile.bin"));
+        o->open();
+        uint8_t chunk[251 * 256];
+        for (size_t n = 0; n < sizeof(chunk); n++)
+            chunk[n] = filePattern(n);
+        for (size_t n = 0; n < FILE_SIZE; n += sizeof(chunk)) {
+            size_t len = FILE_SIZE - n < sizeof(chunk) ? FILE_SIZE - n : sizeof(chunk);
+            ssize_t w = o->forceWrite(chunk, len);
+            TAssert(w == (ssize_t) len);
+        }
+        o->close();
+    }
+
     Events::TaskEvent evtSvr;
+    Events::TaskEvent evtStr;
+    Events::TaskEvent evtFil;
     Events::TaskEvent evtCln;
 
     listener = TaskMan::registerTask(new Listener<Worker>(1234), &evtSvr);
+    streamListener = TaskMan::registerTask(new Listener<Streamer>(1235), &evtStr);
+    fileListener = TaskMan::registerTask(new Listener<FileSender>(1236), &evtFil);
     TaskMan::registerTask(new Client, &evtCln);
 
     waitFor(&evtSvr);
+    waitFor(&evtStr);
+    waitFor(&evtFil);
     waitFor(&evtCln);
 
     Printer::log(M_STATUS, "Created %s", listener->getName());
-    bool svrDone = false, clnDone = false;
-    while (!svrDone || !clnDone) {
+    bool svrDone = false, strDone = false, filDone = false, clnDone = false;
+    while (!svrDone || !strDone || !filDone || !clnDone) {
         yield();
         if (evtSvr.gotSignal()) {
             evtSvr.ack();
             svrDone = true;
         }
+        if (evtStr.gotSignal()) {
+            evtStr.ack();
+            strDone = true;
+        }
+        if (evtFil.gotSignal()) {
+            evtFil.ack();
+            filDone = true;
+        }
         if (evtCln.gotSignal()) {
             evtCln.ack();
             clnDone = true;
@@ -1,6 +1,8 @@
+#include <set>
 #include <Main.h>
 #include <Task.h>
 #include <TaskMan.h>
+#include <TimerWheel.h>
 #include <StacklessTask.h>
 
 using namespace Balau;
@@ -55,6 +57,139 @@ class TestStackless : public StacklessTask {
     TestOperation * m_operation;
 };
 
+class SmallStackTask : public Task {
+  public:
+    virtual const char * getName() const { return "SmallStackTask"; }
+  protected:
+    virtual size_t stackSize() const { return 16 * 1024; }
+  private:
+    virtual void Do() {
+        char buf[4096];
+        memset(buf, 0, sizeof(buf));
+    }
+};
+
+static const int SWITCH_BENCH_ROUNDS = 100000;
+
+class SwitchBenchTask : public Task {
+  public:
+    virtual const char * getName() const { return "SwitchBenchTask"; }
+  private:
+    virtual void Do() {
+        for (int i = 0; i < SWITCH_BENCH_ROUNDS; i++)
+            yieldNoWait();
+    }
+};
+
+#ifdef __linux
+static ucontext_t s_benchMainCtx, s_benchCoCtx;
+
+static void benchSwapContext() {
+    for (;;)
+        swapcontext(&s_benchCoCtx, &s_benchMainCtx);
+}
+
+// raw swapcontext round-trips between the caller's stack and the given one
+static double benchRawSwapContext(void * stack, size_t size) {
+    getcontext(&s_benchCoCtx);
+    s_benchCoCtx.uc_stack.ss_sp = stack;
+    s_benchCoCtx.uc_stack.ss_size = size;
+    s_benchCoCtx.uc_link = NULL;
+    makecontext(&s_benchCoCtx, benchSwapContext, 0);
+    ev_tstamp start = ev_time();
+    for (int i = 0; i < SWITCH_BENCH_ROUNDS; i++)
+        swapcontext(&s_benchMainCtx, &s_benchCoCtx);
+    ev_tstamp end = ev_time();
+    return (end - start) / SWITCH_BENCH_ROUNDS;
+}
+#endif
+
+#ifdef BALAU_ASM_CONTEXT
+static void * s_benchMainSP, * s_benchCoSP;
+
+static void benchSwitchContext(void *) {
+    for (;;)
+        switchContext(&s_benchCoSP, s_benchMainSP);
+}
+
+// the same round-trips, with the switch the tasks use
+static double benchRawSwitchContext(void * stack, size_t size) {
+    s_benchCoSP = prepareContext(stack, size, benchSwitchContext, NULL);
+    ev_tstamp start = ev_time();
+    for (int i = 0; i < SWITCH_BENCH_ROUNDS; i++)
+        switchContext(&s_benchMainSP, s_benchCoSP);
+    ev_tstamp end = ev_time();
+    return (end - start) / SWITCH_BENCH_ROUNDS;
+}
+#endif
+
+static std::atomic<int> s_spreadCount(0);
+static Lock s_spreadLock;
+static std::set<TaskMan *> s_spreadTaskMans;
+
+class SpreadTask : public Task {
+  public:
+    virtual const char * getName() const { return "SpreadTask"; }
+  private:
+    virtual void Do() {
+        {
+            ScopeLock sl(s_spreadLock);
+            s_spreadTaskMans.insert(getTaskMan());
+        }
+        s_spreadCount++;
+        Events::Timeout timeout(0.01);
+        waitFor(&timeout);
+        yield();
+    }
+};
+
+static std::atomic<int> s_wakeReady(0), s_woken(0), s_wokenRemotely(0);
+static std::atomic<TaskMan *> s_wakerTaskMan(NULL);
+
+class WakeTask : public Task {
+  public:
+    virtual const char * getName() const { return "WakeTask"; }
+    Events::Async * getEvent() { return &m_evt; }
+  private:
+    virtual void Do() {
+        waitFor(&m_evt);
+        s_wakeReady++;
+        yield();
+        TAssert(m_evt.gotSignal());
+        s_woken++;
+        if (getTaskMan() != s_wakerTaskMan.load())
+            s_wokenRemotely++;
+    }
+    Events::Async m_evt;
+};
+
+static std::atomic<int> s_priorityReady(0);
+static std::vector<Task::Priority> s_priorityOrder;
+
+class PriorityTask : public Task {
+  public:
+      PriorityTask(Priority priority) { setPriority(priority); }
+    virtual const char * getName() const { return "PriorityTask"; }
+    Events::Async * getEvent() { return &m_evt; }
+  private:
+    virtual void Do() {
+        waitFor(&m_evt);
+        s_priorityReady++;
+        yield();
+        s_priorityOrder.push_back(getPriority());
+    }
+    Events::Async m_evt;
+};
+
+static std::atomic<TaskMan *> s_whereTaskMan(NULL);
+
+class WhereTask : public Task {
+  public:
+    virtual const char * getName() const { return "WhereTask"; }
+  private:
+    virtual void Do() { s_whereTaskMan = getTaskMan(); }
+};
+
 static void yieldingFunction() {
     Events::Timeout timeout(0.2);
     Task::operationYield(&timeout);
@@ -92,6 +227,182 @@ void MainTask::Do() {
     yieldingFunction();
     TAssert(timeout.gotSignal());
 
+    Events::CoarseTimeout coarse(0.05);
+    ev_tstamp coarseStart = ev_now(getLoop());
+    waitFor(&coarse);
+    TAssert(!coarse.gotSignal());
+    yield();
+    TAssert(coarse.gotSignal());
+    TAssert((ev_now(getLoop()) - coarseStart) >= 0.05);
+
+    // reset() takes the timeout out of the wheel and puts it back in, for the whole delay again.
+    coarse.set(0.05);
+    coarse.reset();
+    TAssert(getTaskMan()->getTimerWheel()->size() == 1);
+    coarse.reset();
+    TAssert(getTaskMan()->getTimerWheel()->size() == 1);
+    coarseStart = ev_now(getLoop());
+    waitFor(&coarse);
+    TAssert(!coarse.gotSignal());
+    yield();
+    TAssert(coarse.gotSignal());
+    TAssert((ev_now(getLoop()) - coarseStart) >= 0.05);
+    TAssert(getTaskMan()->getTimerWheel()->size() == 0);
+
+    {
+        // a wheel on a loop that never runs, so that its clock stays put, and we move it ourselves.
+        struct ev_loop * loop = ev_loop_new(EVFLAG_AUTO);
+        {
+            TimerWheel wheel(loop);
+            auto expiry = [loop](ev_tstamp delay) { return uint64_t((ev_now(loop) + delay) / TimerWheel::TICK) + 1; };
+            // in the root wheel; two levels up, so it cascades twice; and beyond the wheel's reach, so it gets clamped.
+            Events::CoarseTimeout root, cascading, clamped;
+            wheel.add(&root, 1.0);
+            wheel.add(&cascading, 700.0);
+            wheel.add(&clamped, 8 * 86400.0);
+            TAssert(wheel.size() == 3);
+            struct { Events::CoarseTimeout * t; ev_tstamp delay; } checks[] = { { &root, 1.0 }, { &cascading, 700.0 }, { &clamped, 8 * 86400.0 } };
+            for (auto & c : checks) {
+                wheel.advance(expiry(c.delay) - 1);
+                TAssert(!c.t->gotSignal());
+                wheel.advance(expiry(c.delay));
+                TAssert(c.t->gotSignal());
+            }
+            TAssert(wheel.size() == 0);
+        }
+        ev_loop_destroy(loop);
+    }
+
+    Task * smallStack = TaskMan::registerTask(new SmallStackTask(), this);
+    taskEvt.attachToTask(smallStack);
+    waitFor(&taskEvt);
+    yield();
+    TAssert(taskEvt.gotSignal());
+    taskEvt.ack();
+    bool foundSmallStacks = false;
+    for (auto & stats : getTaskMan()->getStackPoolStats()) {
+        if (stats.stackSize != 16 * 1024)
+            continue;
+        foundSmallStacks = true;
+        TAssert(stats.inUse + stats.pooled >= 1);
+        TAssert(stats.resident <= stats.pooled);
+    }
+    TAssert(foundSmallStacks);
+
+    Task * switchBench = TaskMan::registerTask(new SwitchBenchTask(), this);
+    taskEvt.attachToTask(switchBench);
+    waitFor(&taskEvt);
+    ev_tstamp benchStart = ev_time();
+    yield();
+    ev_tstamp benchEnd = ev_time();
+    TAssert(taskEvt.gotSignal());
+    taskEvt.ack();
+    Printer::log(M_STATUS, "Task yield round-trip, including the TaskMan loop: %.1fns", (benchEnd - benchStart) / SWITCH_BENCH_ROUNDS * 1e9);
+#ifdef __linux
+    {
+        // both switches go back and forth between this task's stack and the same other one.
+        static const size_t STACK_SIZE = 64 * 1024;
+        void * stack = malloc(STACK_SIZE);
+        Printer::log(M_STATUS, "Raw swapcontext round-trip: %.1fns", benchRawSwapContext(stack, STACK_SIZE) * 1e9);
+#ifdef BALAU_ASM_CONTEXT
+        Printer::log(M_STATUS, "Raw switchContext round-trip: %.1fns", benchRawSwitchContext(stack, STACK_SIZE) * 1e9);
+#endif
+        free(stack);
+    }
+#endif
+
+    // tasks signaled during the same loop run by priority
+    TaskMan::enableTaskStats(true);
+    PriorityTask * low = TaskMan::registerTask(new PriorityTask(PRIORITY_LOW), this);
+    PriorityTask * normal = TaskMan::registerTask(new PriorityTask(PRIORITY_NORMAL), this);
+    PriorityTask * high = TaskMan::registerTask(new PriorityTask(PRIORITY_HIGH), this);
+    Events::TaskEvent lowEvt(low), normalEvt(normal), highEvt(high);
+    while (s_priorityReady.load() != 3)
+        sleep(0.01);
+    low->getEvent()->trigger();
+    normal->getEvent()->trigger();
+    high->getEvent()->trigger();
+    waitFor(&lowEvt);
+    waitFor(&normalEvt);
+    waitFor(&highEvt);
+    while (!lowEvt.gotSignal() || !normalEvt.gotSignal() || !highEvt.gotSignal())
+        yield();
+    TAssert(s_priorityOrder.size() == 3);
+    TAssert(s_priorityOrder[0] == PRIORITY_HIGH);
+    TAssert(s_priorityOrder[1] == PRIORITY_NORMAL);
+    TAssert(s_priorityOrder[2] == PRIORITY_LOW);
+    TaskMan::enableTaskStats(false);
+    bool foundPriorityStats = false;
+    for (auto & stats : TaskMan::getTaskStats()) {
+        if (stats.className != "PriorityTask")
+            continue;
+        foundPriorityStats = true;
+        TAssert(stats.switches >= 6);
+        uint64_t latencies = 0;
+        for (int i = 0; i < TaskMan::LATENCY_BUCKETS; i++)
+            latencies += stats.latencies[i];
+        TAssert(latencies == stats.switches);
+    }
+    TAssert(foundPriorityStats);
+
+    static const int NTHREADS = 2;
+    static const int NTASKS = 64;
+    TaskMan::TaskManThread * tms[NTHREADS];
+    for (int i = 0; i < NTHREADS; i++)
+        tms[i] = TaskMan::createThreadedTaskMan();
+    for (int i = 0; i < NTHREADS; i++)
+        TAssert(tms[i]->getTaskMan());
+    // the ones that stay on our TaskMan pile up there until we yield, and the idle TaskMans have to steal them;
+    // so we don't yield until one did.
+    TaskMan::SchedulerStats schedBefore = TaskMan::getSchedulerStats();
+    for (int i = 0; i < NTASKS; i++)
+        TaskMan::registerTask(new SpreadTask());
+    ev_tstamp stealDeadline = ev_time() + 1;
+    while ((TaskMan::getSchedulerStats().steals == schedBefore.steals) && (ev_time() < stealDeadline))
+        sched_yield();
+    while (s_spreadCount.load() != NTASKS)
+        sleep(0.01);
+    TaskMan::SchedulerStats schedAfter = TaskMan::getSchedulerStats();
+    Printer::log(M_STATUS, "%i tasks ran on %zu TaskMans; %" PRIu64 " steals took %" PRIu64 " tasks", NTASKS, s_spreadTaskMans.size(), schedAfter.steals - schedBefore.steals, schedAfter.stolenTasks - schedBefore.stolenTasks);
+    TAssert(s_spreadTaskMans.size() > 1);
+    TAssert(schedAfter.steals > schedBefore.steals);
+
+    // registering a task on an explicit, pinned, TaskMan
+    TaskMan::TaskManThread * pinned = TaskMan::createThreadedTaskMan(0);
+    TaskMan * pinnedTaskMan = pinned->getTaskMan();
+    TAssert(pinnedTaskMan);
+    Events::TaskEvent whereEvt;
+    TaskMan::registerTask(new WhereTask(), pinnedTaskMan, &whereEvt);
+    waitFor(&whereEvt);
+    while (!whereEvt.gotSignal())
+        yield();
+    TAssert(s_whereTaskMan.load() == pinnedTaskMan);
+    TaskMan::stopThreadedTaskMan(pinned);
+
+    // waking up a whole batch of tasks living on other threads; they're pinned there, so we're sure of it.
+    WakeTask * wakeTasks[NTASKS];
+    Events::TaskEvent * wakeEvents[NTASKS];
+    for (int i = 0; i < NTASKS; i++) {
+        wakeEvents[i] = new Events::TaskEvent();
+        wakeTasks[i] = TaskMan::registerTask(new WakeTask(), tms[i % NTHREADS]->getTaskMan(), wakeEvents[i]);
+        waitFor(wakeEvents[i]);
+    }
+    while (s_wakeReady.load() != NTASKS)
+        sleep(0.01);
+    s_wakerTaskMan = getTaskMan();
+    for (int i = 0; i < NTASKS; i++)
+        wakeTasks[i]->getEvent()->trigger();
+    for (int i = 0; i < NTASKS; i++) {
+        while (!wakeEvents[i]->gotSignal())
+            yield();
+        delete wakeEvents[i];
+    }
+    TAssert(s_woken.load() == NTASKS);
+    TAssert(s_wokenRemotely.load() == NTASKS);
+
+    for (int i = 0; i < NTHREADS; i++)
+        TaskMan::stopThreadedTaskMan(tms[i]);
+
     Printer::log(M_STATUS, "Test::Tasks passed.");
     Printer::log(M_DEBUG, "You shouldn't see that message.");
 }
@@ -1,5 +1,6 @@
 #include <Main.h>
 #include <Threads.h>
+#include <Task.h>
 
 using namespace Balau;
 
@@ -15,6 +16,91 @@ void * TestThread::proc() {
     return NULL;
 }
 
+// The queue as it was before being made lock-free, for the benchmark below.
+class LockedQueue {
+  public:
+      LockedQueue() { pthread_mutex_init(&m_lock, NULL); pthread_cond_init(&m_cond, NULL); }
+      ~LockedQueue() { pthread_cond_destroy(&m_cond); pthread_mutex_destroy(&m_lock); }
+    void push(void * t) {
+        pthread_mutex_lock(&m_lock);
+        Cell * c = new Cell(t);
+        c->m_prev = m_back;
+        if (m_back)
+            m_back->m_next = c;
+        else
+            m_front = c;
+        m_back = c;
+        pthread_cond_signal(&m_cond);
+        pthread_mutex_unlock(&m_lock);
+    }
+    void * pop() {
+        pthread_mutex_lock(&m_lock);
+        while (!m_front)
+            pthread_cond_wait(&m_cond, &m_lock);
+        Cell * c = m_front;
+        m_front = c->m_next;
+        if (m_front)
+            m_front->m_prev = NULL;
+        else
+            m_back = NULL;
+        pthread_mutex_unlock(&m_lock);
+        void * t = c->m_elem;
+        delete c;
+        return t;
+    }
+  private:
+    struct Cell {
+          Cell(void * elem) : m_elem(elem) { }
+        Cell * m_next = NULL, * m_prev = NULL;
+        void * m_elem;
+    };
+    pthread_mutex_t m_lock;
+    Cell * m_front = NULL, * m_back = NULL;
+    pthread_cond_t m_cond;
+};
+
+struct BenchItem : public QueueNode {
+    int value;
+};
+
+static const int BENCH_ITEMS = 20000;
+
+template<class Q>
+class BenchProducer : public Thread {
+  public:
+      BenchProducer(Q * queue, BenchItem * items) : m_queue(queue), m_items(items) { }
+  private:
+    virtual void * proc() {
+        for (int i = 0; i < BENCH_ITEMS; i++)
+            m_queue->push(m_items + i);
+        return NULL;
+    }
+    Q * m_queue;
+    BenchItem * m_items;
+};
+
+template<class Q>
+static double benchQueue(int nProducers) {
+    Q queue;
+    BenchItem * items = new BenchItem[nProducers * BENCH_ITEMS];
+    BenchProducer<Q> ** producers = new BenchProducer<Q> *[nProducers];
+    for (int i = 0; i < nProducers; i++)
+        producers[i] = new BenchProducer<Q>(&queue, items + i * BENCH_ITEMS);
+    ev_tstamp start = ev_time();
+    for (int i = 0; i < nProducers; i++)
+        producers[i]->threadStart();
+    for (int i = 0; i < nProducers * BENCH_ITEMS; i++)
+        TAssert(queue.pop());
+    ev_tstamp end = ev_time();
+    for (int i = 0; i < nProducers; i++) {
+        producers[i]->join();
+        delete producers[i];
+    }
+    delete[] producers;
+    delete[] items;
+    return end - start;
+}
+
 void MainTask::Do() {
     Printer::log(M_STATUS, "Test::Threads running.");
 
@@ -28,5 +114,11 @@ void MainTask::Do() {
 
     TAssert(threadWorked);
 
+    for (int nProducers = 1; nProducers <= 32; nProducers *= 2) {
+        double locked = benchQueue<LockedQueue>(nProducers);
+        double lockFree = benchQueue<Queue<BenchItem>>(nProducers);
+        Printer::log(M_STATUS, "%2i producers, %i items each: locked queue %.3fs, lock-free queue %.3fs", nProducers, BENCH_ITEMS, locked, lockFree);
+    }
+
     Printer::log(M_STATUS, "Test::Threads passed.");
 }